@@ -64,6 +64,91 @@ struct xpmem_addr {
 #define XPMEM_RDONLY	0x1
 #define XPMEM_RDWR	0x2
 
+/*
+ * xpmem_version() returns at least XPMEM_VERSION_FLAGS when the kernel
+ * module provides xpmem_make_flags(), xpmem_seal(), xpmem_attach_flags()
+ * and xpmem_prefetch().
+ */
+#define XPMEM_VERSION_FLAGS	0x00027000
+
+/*
+ * Flags for xpmem_make_flags()
+ */
+/** Pin the whole range once and share the pinned pages with all consumers.
+ * The range must be mapped in full. Consumers keep seeing these pages even
+ * if the source later unmaps or remaps part of the range. On Linux 5.9 or
+ * later the pages are pinned long-term: they are moved out of ZONE_MOVABLE
+ * and CMA first, and a fork() of the source copies them for the child, so
+ * the source's own writes still reach the consumers. On older kernels the
+ * source should not fork() while the segment exists. */
+#define XPMEM_MAKE_PIN			0x1
+/** Migrate source pages towards the NUMA node of the consumers that fault
+ * on them most. Needs kernel support for migrate_vma (CONFIG_DEVICE_PRIVATE
+ * or CONFIG_DEVICE_MIGRATION, Linux 5.9 or later). Not allowed together with
+ * XPMEM_MAKE_PIN. */
+#define XPMEM_MAKE_MIGRATE		0x2
+
+/*
+ * Flags for xpmem_attach_flags()
+ */
+/** Map only the faulting page on each fault (disable fault-around) */
+#define XPMEM_ATTACH_NOFAULTAROUND	0x1
+/** Pin and map the whole range before xpmem_attach_flags() returns */
+#define XPMEM_ATTACH_POPULATE		0x2
+/** Map read-only. Untouched source memory is backed by the zero page rather
+ * than allocated. Implied when attaching an XPMEM_RDONLY permit. */
+#define XPMEM_ATTACH_RDONLY		0x4
+/** Map source pages without pinning them, so the source can still migrate,
+ * compact or collapse them. Affected pages are refaulted afterwards. Needs
+ * kernel HMM support (CONFIG_HMM_MIRROR, Linux 5.10 or later). */
+#define XPMEM_ATTACH_NOPIN		0x8
+/** Map pages of sealed segments (see xpmem_seal()) from copies on the NUMA
+ * node of the faulting thread. The copies are made on first use, shared by
+ * all attachments of the segment and kept until it is removed. Needs
+ * XPMEM_ATTACH_RDONLY. Pages of segments that are not sealed are mapped as
+ * usual. */
+#define XPMEM_ATTACH_REPLICATE		0x10
+/** Map source pages as ordinary pages rather than raw PFNs, so that
+ * get_user_pages() based interfaces (O_DIRECT, vmsplice, RDMA registration,
+ * process_vm_readv, ...) accept the attachment. Only pages that are not
+ * anonymous qualify: shared memory (MAP_SHARED, shm, memfd) and regular
+ * files. Anonymous pages, and file pages of XPMEM_MAKE_PIN or sealed
+ * segments, are still mapped as PFNs. The attachment is mapped with base
+ * pages only. Needs a 64-bit kernel with special PTE support (Linux 4.18 or
+ * later). */
+#define XPMEM_ATTACH_PAGES		0x20
+/** Let faults on parts of the source range that the source has not mapped
+ * yet wait until it does, instead of raising SIGBUS right away. This allows
+ * attaching before the source has allocated the memory. Faults give up with
+ * SIGBUS after the attach_wait_ms module parameter (10 seconds by default)
+ * and can be interrupted by fatal signals. Accesses the kernel cannot retry,
+ * such as some get_user_pages() callers, fail without waiting. */
+#define XPMEM_ATTACH_WAIT		0x40
+/** Map the attachment at the address the memory has in the source, so that
+ * pointers stored in it can be followed as they are. Fails with EEXIST if
+ * part of that range is already mapped. A vaddr passed along must be that
+ * address (rounded down to a page). Needs Linux 4.17 or later. */
+#define XPMEM_ATTACH_SAMEVA		0x80
+
+/*
+ * Placement policies for xpmem_make_flags() and xpmem_attach_flags()
+ *
+ * They choose the NUMA node of source pages that have to be allocated when a
+ * consumer touches them first. At most one policy may be given. A policy
+ * given at attach time overrides the one of the segment. Without any policy
+ * pages are placed on the node the source runs on.
+ */
+/** Place pages on the node the source runs on */
+#define XPMEM_PLACE_SOURCE		0x0100
+/** Place pages on the node of the consumer thread touching them */
+#define XPMEM_PLACE_CONSUMER		0x0200
+/** Spread pages over all online nodes in PMD sized chunks */
+#define XPMEM_PLACE_INTERLEAVE		0x0300
+/** Place pages on NUMA node n */
+#define XPMEM_PLACE_NODE(n)		(0x0400 | ((n) << XPMEM_PLACE_NODE_SHIFT))
+#define XPMEM_PLACE_MASK		0x0700
+#define XPMEM_PLACE_NODE_SHIFT		16
+
 /*
  * Valid permit_type values for xpmem_make().
  */
@@ -93,6 +178,11 @@ int xpmem_version (void);
  * @permit_value: IN: permissions mode expressed as an octal value
  * Description:
  *	xpmem_make() shares a memory block by invoking the XPMEM driver.
+ *	The block may include memory attached with xpmem_attach(), which is
+ *	then shared on: consumers map the original owner's pages and lose
+ *	them when the owner's mapping changes. At most four attachments can
+ *	be chained this way. Such blocks cannot be pinned with
+ *	XPMEM_MAKE_PIN or xpmem_seal().
  * Context:
  *	Called by the source process to obtain a segment ID to share with other
  *	processes. It is common to call this function with vadder = NULL and
@@ -104,6 +194,23 @@ int xpmem_version (void);
  */
 xpmem_segid_t xpmem_make (void *vaddr, size_t size, int permit_type, void *permit_value);
 
+/**
+ * xpmem_make_flags - share a memory block with make flags
+ * @vaddr: IN: starting address of region to share
+ * @size: IN: number of bytes to share
+ * @permit_type: IN: only XPMEM_PERMIT_MODE currently defined
+ * @permit_value: IN: permissions mode expressed as an octal value
+ * @flags: IN: bitwise OR of XPMEM_MAKE_* flags
+ * Description:
+ *	Same as xpmem_make() but allows the caller to choose how the segment
+ *	is backed. See the XPMEM_MAKE_* flags above.
+ * Return Value:
+ *	Success: 64-bit segment ID (xpmem_segid_t)
+ *	Failure: -1
+ */
+xpmem_segid_t xpmem_make_flags (void *vaddr, size_t size, int permit_type,
+				void *permit_value, int flags);
+
 /**
  * xpmem_remove - revoke access to a shared memory block
  * @segid: IN: 64-bit segment ID of the region to stop sharing
@@ -119,6 +226,26 @@ xpmem_segid_t xpmem_make (void *vaddr, size_t size, int permit_type, void *permi
  */
 int xpmem_remove (xpmem_segid_t segid);
 
+/**
+ * xpmem_seal - make a shared memory block immutable
+ * @segid: IN: 64-bit segment ID of the region to seal
+ * Description:
+ *	Pins the whole region once, as XPMEM_MAKE_PIN does, so that consumers
+ *	keep their mappings no matter what happens to the source's page
+ *	tables, and makes faults on it skip the bookkeeping needed for
+ *	mutable segments. The region must be mapped in full. Sealing cannot
+ *	be undone and is not allowed for XPMEM_MAKE_MIGRATE segments.
+ * Context:
+ *	Called by the source process once the region holds its final
+ *	contents. The source promises not to unmap, remap or write the
+ *	region afterwards. Consumers do not see remaps of the region, while
+ *	writes to the pinned pages stay visible to them.
+ * Return Value:
+ *	Success: 0
+ *	Failure: -1
+ */
+int xpmem_seal (xpmem_segid_t segid);
+
 /**
  * xpmem_get - obtain permission to attach memory
  * @segid: IN: segment ID returned from a previous xpmem_make() call
@@ -167,13 +294,51 @@ int xpmem_release (xpmem_apid_t apid);
  *	Called by the consumer to get a mapping between the shared source
  *	address and an address in the consumer process' own address space. If
  *	the mapping is successful, then the consumer process can now begin
- *	accessing the shared memory.
+ *	accessing the shared memory. Permits obtained with XPMEM_RDONLY are
+ *	mapped read-only.
  * Return Value:
  *	Success: virtual address at which the mapping was created
  *	Failure: -1
  */
 void *xpmem_attach (struct xpmem_addr addr, size_t size, void *vaddr);
 
+/**
+ * xpmem_attach_flags - map a source address with attach flags
+ * @addr: IN: a structure consisting of a xpmem_apid_t apid and an off_t offset
+ * @size: IN: number of bytes to map
+ * @vaddr: IN: address at which the mapping should be created, or NULL if the
+ *		kernel should choose
+ * @flags: IN: bitwise OR of XPMEM_ATTACH_* flags
+ * Description:
+ *	Same as xpmem_attach() but allows the caller to tune how the
+ *	attachment is populated. See the XPMEM_ATTACH_* flags above.
+ * Return Value:
+ *	Success: virtual address at which the mapping was created
+ *	Failure: -1
+ */
+void *xpmem_attach_flags (struct xpmem_addr addr, size_t size, void *vaddr,
+			  int flags);
+
+/**
+ * xpmem_prefetch - populate part of an attachment in the background
+ * @vaddr: IN: start of the range to populate, within an XPMEM mapping in the
+ *		consumer's address space
+ * @size: IN: number of bytes to populate
+ * Description:
+ *	Queues the pages of the range to be pinned and mapped by the kernel
+ *	and returns without waiting, similar to madvise(MADV_WILLNEED). Pages
+ *	that are not populated yet when accessed are faulted in as usual.
+ *	While a prefetch of an attachment is still queued, further ones
+ *	widen its range rather than queueing more work.
+ * Context:
+ *	Called by the consumer ahead of accessing an attachment. The range
+ *	must lie within a single attachment.
+ * Return Value:
+ *	Success: 0
+ *	Failure: -1
+ */
+int xpmem_prefetch (void *vaddr, size_t size);
+
 /**
  * xpmem_detach - remove a mapping between consumer and source
  * @vaddr: IN: virtual address within an XPMEM mapping in the consumer's
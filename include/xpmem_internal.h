@@ -110,7 +110,7 @@ struct xpmem_cmd_attach {
   __u64 vaddr;
   /** File descriptor (not used). For compatibility with Cray XPMEM. */
   int fd;
-  /** Attach flags (not used). For compatibility with Cray XPMEM. */
+  /** Attach flags (XPMEM_ATTACH_*) */
   int flags;
 };
 typedef struct xpmem_cmd_attach xpmem_cmd_attach_t;
@@ -130,6 +130,37 @@ typedef struct xpmem_cmd_detach xpmem_cmd_detach_t;
 #define XPMEM_CMD_FORK_BEGIN _IO('x', 7)
 #define XPMEM_CMD_FORK_END   _IO('x', 8)
 
+/** ioctl to populate part of an attachment in the background */
+#define XPMEM_CMD_PREFETCH   _IO('x', 9)
+
+/**
+ * Structure to pass data for XPMEM_CMD_PREFETCH ioctl
+ */
+struct xpmem_cmd_prefetch {
+  /** Local address of the start of the range to populate */
+  __u64 vaddr;
+  /** Size of the range. The range must lie within one attachment. */
+  size_t size;
+};
+typedef struct xpmem_cmd_prefetch xpmem_cmd_prefetch_t;
+
+/** ioctl to create an xpmem segment with make flags */
+#define XPMEM_CMD_MAKE_FLAGS _IO('x', 10)
+
+/**
+ * Structure to pass data for XPMEM_CMD_MAKE_FLAGS ioctl
+ */
+struct xpmem_cmd_make_flags {
+  /** Segment to create, as for XPMEM_CMD_MAKE (segid is returned here) */
+  struct xpmem_cmd_make make;
+  /** Make flags (XPMEM_MAKE_*) */
+  int flags;
+};
+typedef struct xpmem_cmd_make_flags xpmem_cmd_make_flags_t;
+
+/** ioctl to seal an xpmem segment, takes a struct xpmem_cmd_remove */
+#define XPMEM_CMD_SEAL       _IO('x', 11)
+
 /*
  * path to XPMEM device
  */
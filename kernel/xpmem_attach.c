@@ -17,16 +17,136 @@
  */
 
 #include <linux/err.h>
+#include <linux/interval_tree_generic.h>
 #include <linux/mm.h>
 #include <linux/mman.h>
 #include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
 #include "xpmem_internal.h"
 #include "xpmem_private.h"
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
+#include <linux/sched/mm.h>
 #endif
 
+#ifdef XPMEM_HAVE_HUGE_FAULT
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#endif
+
+#ifdef XPMEM_HAVE_ATTACH_PAGES
+#include <linux/pfn_t.h>
+#endif
+
+#ifdef XPMEM_HAVE_HMM
+#include <linux/hmm.h>
+#endif
+
+static void xpmem_att_nopin_remove(struct xpmem_attachment *);
+static u64 xpmem_clear_PTEs_of_att_locked(struct xpmem_attachment *, u64, u64,
+					  int, u64 *);
+
+/*
+ * Interval tree of a segment's attachments, keyed by the source addresses
+ * they map, so that clearing the PTEs of a source range only visits the
+ * attachments overlapping it.
+ */
+#define xpmem_att_start(_att)	((_att)->vaddr)
+#define xpmem_att_last(_att)	((_att)->vaddr + (_att)->at_size - 1)
+
+INTERVAL_TREE_DEFINE(struct xpmem_attachment, att_node, u64, att_subtree_last,
+		     xpmem_att_start, xpmem_att_last, static, xpmem_att_tree)
+
+/*
+ * Link att into its segment's interval tree once it is on its access
+ * permit's att_list.
+ */
+static void
+xpmem_att_link(struct xpmem_attachment *att)
+{
+	struct xpmem_segment *seg = att->ap->seg;
+
+	spin_lock(&seg->lock);
+	xpmem_att_tree_insert(att, &seg->att_tree);
+	spin_unlock(&seg->lock);
+}
+
+/*
+ * Unlink att from its segment's interval tree and its access permit's
+ * att_list. It leaves the tree first, so that an att found in the tree
+ * always has a live access permit.
+ */
+static void
+xpmem_att_unlink(struct xpmem_attachment *att)
+{
+	struct xpmem_access_permit *ap = att->ap;
+	struct xpmem_segment *seg = ap->seg;
+
+	spin_lock(&seg->lock);
+	if (!RB_EMPTY_NODE(&att->att_node)) {
+		xpmem_att_tree_remove(att, &seg->att_tree);
+		RB_CLEAR_NODE(&att->att_node);
+	}
+	spin_unlock(&seg->lock);
+
+	spin_lock(&ap->lock);
+	list_del_init(&att->att_list);
+	spin_unlock(&ap->lock);
+}
+
+/*
+ * Note that att has valid PTEs. The first time around, count it in its
+ * segment and widen the source range its thread group has mapped remotely,
+ * which the MMU notifier checks before doing anything else.
+ */
+static void
+xpmem_att_set_validPTEs(struct xpmem_attachment *att)
+{
+	struct xpmem_segment *seg = att->ap->seg;
+	struct xpmem_thread_group *seg_tg = seg->tg;
+	u64 start = att->vaddr, end = att->vaddr + att->at_size;
+
+	/* avoid dirtying the shared att cacheline once the flag is set */
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_VALIDPTEs) ||
+	    xpmem_att_test_and_set_flag(att, XPMEM_FLAG_VALIDPTEs))
+		return;
+
+	atomic_inc(&seg->n_att_mapped);
+	spin_lock(&seg_tg->lock);
+	if (atomic_read(&seg_tg->n_att_mapped) == 0) {
+		WRITE_ONCE(seg_tg->mapped_start, start);
+		WRITE_ONCE(seg_tg->mapped_end, end);
+	} else {
+		if (start < seg_tg->mapped_start)
+			WRITE_ONCE(seg_tg->mapped_start, start);
+		if (end > seg_tg->mapped_end)
+			WRITE_ONCE(seg_tg->mapped_end, end);
+	}
+	smp_wmb();	/* pairs with xpmem_tg_range_mapped() */
+	atomic_inc(&seg_tg->n_att_mapped);
+	spin_unlock(&seg_tg->lock);
+}
+
+/*
+ * Note that att has no valid PTEs left and stop counting it.
+ */
+static void
+xpmem_att_clear_validPTEs(struct xpmem_attachment *att)
+{
+	struct xpmem_segment *seg = att->ap->seg;
+	struct xpmem_thread_group *seg_tg = seg->tg;
+
+	if (!xpmem_att_test_and_clear_flag(att, XPMEM_FLAG_VALIDPTEs))
+		return;
+
+	atomic_dec(&seg->n_att_mapped);
+	spin_lock(&seg_tg->lock);
+	atomic_dec(&seg_tg->n_att_mapped);
+	spin_unlock(&seg_tg->lock);
+}
+
 static void
 xpmem_open_handler(struct vm_area_struct *vma)
 {
@@ -61,6 +181,8 @@ xpmem_close_handler(struct vm_area_struct *vma)
 	u64 remaining_vaddr;
 	struct xpmem_access_permit *ap;
 	struct xpmem_attachment *att;
+	struct xpmem_segment *seg;
+	int linked;
 
 	att = (struct xpmem_attachment *)vma->vm_private_data;
 	if (att == NULL) {
@@ -73,7 +195,7 @@ xpmem_close_handler(struct vm_area_struct *vma)
 	xpmem_att_ref(att);
 	mutex_lock(&att->mutex);
 
-	if (att->flags & XPMEM_FLAG_DESTROYING) {
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING)) {
 		/* the unmap is being done normally via a detach operation */
 		mutex_unlock(&att->mutex);
 		xpmem_att_deref(att);
@@ -88,17 +210,17 @@ xpmem_close_handler(struct vm_area_struct *vma)
 	 */
 	if (vma->vm_start == att->at_vaddr &&
 	    ((vma->vm_end - vma->vm_start) == att->at_size)) {
-		att->flags |= XPMEM_FLAG_DESTROYING;
+		xpmem_att_set_flag(att, XPMEM_FLAG_DESTROYING);
 
 		ap = att->ap;
 		xpmem_ap_ref(ap);
 
-		spin_lock(&ap->lock);
-		list_del_init(&att->att_list);
-		spin_unlock(&ap->lock);
+		xpmem_att_clear_validPTEs(att);
+		xpmem_att_unlink(att);
 
 		xpmem_ap_deref(ap);
 
+		xpmem_att_nopin_remove(att);
 		xpmem_att_destroyable(att);
 		goto out;
 	}
@@ -142,8 +264,17 @@ xpmem_close_handler(struct vm_area_struct *vma)
 	       remaining_vma->vm_start > remaining_vaddr ||
 	       remaining_vma->vm_private_data != vma->vm_private_data);
 
+	/* at_size is part of att's key in its segment's interval tree */
+	seg = att->ap->seg;
+	spin_lock(&seg->lock);
+	linked = !RB_EMPTY_NODE(&att->att_node);
+	if (linked)
+		xpmem_att_tree_remove(att, &seg->att_tree);
 	att->at_vaddr = remaining_vma->vm_start;
 	att->at_size = remaining_vma->vm_end - remaining_vma->vm_start;
+	if (linked)
+		xpmem_att_tree_insert(att, &seg->att_tree);
+	spin_unlock(&seg->lock);
 
 	/* clear out the private data for the vma being unmapped */
 	vma->vm_private_data = NULL;
@@ -162,228 +293,1653 @@ out:
 #endif
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
-static vm_fault_t
-xpmem_fault_handler(struct vm_fault *vmf)
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
-int
-xpmem_fault_handler(struct vm_fault *vmf)
-#else
+/*
+ * Drop the pins on nr_pages contiguous PFNs taken by
+ * xpmem_ensure_valid_PFNs() or xpmem_ensure_valid_huge_PFN() that did not
+ * end up being mapped into the attachment.
+ */
+static void
+xpmem_release_pfns(struct xpmem_segment *seg, unsigned long pfn,
+		   unsigned long nr_pages)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr_pages; i++)
+		xpmem_put_page(pfn_to_page(pfn + i));
+	atomic_sub(nr_pages, &seg->tg->n_pinned);
+	atomic_add(nr_pages, &xpmem_my_part->n_unpinned);
+}
+
+/*
+ * Work out how many pages to map for a fault at vaddr. Similar to file
+ * readahead, the window doubles each time a fault lands right after the
+ * previous window and halves otherwise. The result never extends beyond the
+ * attachment or the vma.
+ */
 static int
-xpmem_fault_handler(struct vm_area_struct *vma, struct vm_fault *vmf)
-#endif
+xpmem_fault_around_size(struct xpmem_attachment *att,
+			struct vm_area_struct *vma, u64 vaddr)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
-	vm_fault_t ret;
-#else
-	int ret;
+	unsigned int window, max_window;
+	u64 end;
+
+	max_window = min_t(unsigned int, xpmem_fault_around_pages,
+			   XPMEM_FAULT_AROUND_MAX);
+	if ((att->attach_flags & XPMEM_ATTACH_NOFAULTAROUND) || max_window <= 1)
+		return 1;
+
+	/*
+	 * Concurrent faults on other ranges of the attachment may update the
+	 * window at the same time. It is only a heuristic so a lost update
+	 * is harmless.
+	 */
+	window = READ_ONCE(att->fault_window);
+	if (vaddr == READ_ONCE(att->fault_next))
+		window = min(window * 2, max_window);
+	else
+		window = max(window / 2, 1U);
+	WRITE_ONCE(att->fault_window, window);
+
+	/* stay within the range covered by the fault lock, see below */
+	end = min_t(u64, att->at_vaddr + att->at_size, vma->vm_end);
+	end = min_t(u64, end, (vaddr & PMD_MASK) + PMD_SIZE);
+	return min_t(u64, window, (end - vaddr) >> PAGE_SHIFT);
+}
+
+/*
+ * Faults on an attachment are serialized per PMD sized range of the
+ * attachment rather than per attachment, so threads faulting on different
+ * parts of one attachment proceed in parallel. A fault never maps beyond the
+ * PMD range it locked, except for PUD sized faults which all use the lock of
+ * the first PMD range in the PUD.
+ */
+static struct mutex *
+xpmem_att_fault_lock(struct xpmem_attachment *att, u64 vaddr,
+		     unsigned int order)
+{
+	if (order >= PUD_SHIFT - PAGE_SHIFT)
+		vaddr &= PUD_MASK;
+
+	return &att->fault_mutex[(vaddr >> PMD_SHIFT) %
+				 XPMEM_ATT_FAULT_LOCKS];
+}
+
+#ifdef XPMEM_HAVE_ATTACH_PAGES
+/* next free mmap offset of XPMEM_ATTACH_PAGES attachments, in pages */
+static atomic_long_t xpmem_pages_pgoff = ATOMIC_LONG_INIT(XPMEM_PAGES_PGOFF);
+
+/*
+ * Whether page can be mapped into an XPMEM_ATTACH_PAGES attachment as an
+ * ordinary page, with a reference and rmap of its own. vm_insert_page()
+ * refuses anonymous pages, whose rmap belongs to the source. File pages of
+ * segments that stay pinned are left out too: consumers keep mapping them
+ * after the source unmaps them, which truncation must never see.
+ */
+static inline int
+xpmem_att_page_insertable(struct xpmem_attachment *att, struct page *page)
+{
+	if (PageAnon(page) || PageSlab(page) || PageHuge(page) ||
+	    is_zero_pfn(page_to_pfn(page)))
+		return 0;
+
+	return !page->mapping || !(att->ap->seg->make_flags & XPMEM_MAKE_PIN);
+}
 #endif
-	int att_locked = 0;
-	int seg_tg_mmap_sem_locked = 0, vma_verification_needed = 0;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
-	u64 vaddr = (u64)(uintptr_t) vmf->address;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
-        struct vm_area_struct *vma = vmf->vma;
+
+/*
+ * Insert a single PFN. remap_pfn_range() updates vm_flags, which needs the
+ * mmap_lock held for writing on kernels with per-VMA locks, so newer kernels
+ * use the fault time interface instead. XPMEM_ATTACH_PAGES attachments map
+ * the page itself where they can, so that GUP finds it.
+ */
+static int
+xpmem_insert_pfn(struct vm_area_struct *vma, u64 vaddr, unsigned long pfn)
+{
+#ifdef XPMEM_HAVE_ATTACH_PAGES
+	if (vma->vm_flags & VM_MIXEDMAP) {
+		struct page *page = pfn_to_page(pfn);
+
+		if (xpmem_att_page_insertable(vma->vm_private_data, page))
+			return vm_insert_page(vma, vaddr, page);
+
+		return (vmf_insert_mixed(vma, vaddr,
+					 __pfn_to_pfn_t(pfn, PFN_DEV)) ==
+			VM_FAULT_NOPAGE) ? 0 : -EFAULT;
+	}
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	return (vmf_insert_pfn_prot(vma, vaddr, pfn, vma->vm_page_prot) ==
+		VM_FAULT_NOPAGE) ? 0 : -EFAULT;
 #else
-        u64 vaddr = (u64)(uintptr_t) vmf->virtual_address;
+	return remap_pfn_range(vma, vaddr, pfn, PAGE_SIZE, vma->vm_page_prot);
 #endif
-	u64 seg_vaddr;
-	unsigned long pfn = 0, old_pfn = 0;
-	struct xpmem_thread_group *ap_tg, *seg_tg;
-	struct xpmem_access_permit *ap;
-	struct xpmem_attachment *att;
-	struct xpmem_segment *seg;
+}
 
-	if (current->flags & PF_DUMPCORE)
-		return VM_FAULT_SIGBUS;
+/*
+ * Consumers of segments that att's thread group made over the attachment may
+ * have pinned pages at [vaddr, vaddr + size) of it. Clear their PTEs as well
+ * once att stops mapping them. The mmu notifier of att->mm leaves this to us
+ * since it skips XPMEM attachments.
+ */
+static void
+xpmem_att_invalidate_reexports(struct xpmem_attachment *att, u64 vaddr,
+			       u64 size)
+{
+	xpmem_invalidate_PTEs_range(att->ap->tg, vaddr, vaddr + size);
+}
 
-	att = (struct xpmem_attachment *)vma->vm_private_data;
-	if (att == NULL) {
-		/*
-		 * Users who effectively bypass xpmem_attach() by opening
-		 * and mapping /dev/xpmem will have a NULL finfo and will
-		 * be killed here.
-		 */
-		return VM_FAULT_SIGBUS;
-	}
-	xpmem_att_ref(att);
-	ap = att->ap;
-	xpmem_ap_ref(ap);
-	ap_tg = ap->tg;
-	xpmem_tg_ref(ap_tg);
-	if ((ap->flags & XPMEM_FLAG_DESTROYING) ||
-	    (ap_tg->flags & XPMEM_FLAG_DESTROYING)) {
-		xpmem_att_deref(att);
-		xpmem_ap_deref(ap);
-		xpmem_tg_deref(ap_tg);
-		return VM_FAULT_SIGBUS;
+/*
+ * Zap the PTEs of [vaddr, vaddr + size) in an attachment vma. zap_vma_ptes()
+ * ignores the VM_MIXEDMAP vmas of XPMEM_ATTACH_PAGES attachments, which are
+ * zapped by their offsets in the /dev/xpmem mapping instead.
+ */
+static void
+xpmem_zap_ptes(struct vm_area_struct *vma, u64 vaddr, u64 size)
+{
+#ifdef XPMEM_HAVE_ATTACH_PAGES
+	if (vma && (vma->vm_flags & VM_MIXEDMAP)) {
+		unmap_mapping_range(vma->vm_file->f_mapping,
+				    ((loff_t)vma->vm_pgoff << PAGE_SHIFT) +
+				    (vaddr - vma->vm_start), size, 1);
+		return;
 	}
-	DBUG_ON(current->tgid != ap_tg->tgid);
-	DBUG_ON(ap->mode != XPMEM_RDWR);
+#endif
+	(void) zap_vma_ptes(vma, vaddr, size);
+}
 
-	seg = ap->seg;
-	xpmem_seg_ref(seg);
-	seg_tg = seg->tg;
-	xpmem_tg_ref(seg_tg);
+/*
+ * Map the n_pfns pinned PFNs in pfns at consecutive pages starting at vaddr.
+ * Racing threads must not each insert the PFN for a given virtual address.
+ * To account for this, the caller holds the fault lock of the range and we
+ * don't perform the redundant insert when a PFN already exists. Pages that
+ * are already mapped or fail to map are simply released, unless seg is NULL
+ * because the PFNs are not pinned. Returns 0 if the first page ends up
+ * mapped.
+ */
+static int
+xpmem_map_pfns(struct vm_area_struct *vma, struct xpmem_segment *seg,
+	       u64 vaddr, unsigned long *pfns, int n_pfns)
+{
+	unsigned long pfn, old_pfn;
+	int i, ret = -EFAULT;
 
-	/*
-	 * The faulting thread has its mmap_sem/mmap_lock locked on entrance to this
-	 * fault handler. In order to supply the missing page we will need
-	 * to get access to the segment that has it, as well as lock the
-	 * mmap_sem/mmap_lock of the thread group that owns the segment should it be
-	 * different from the faulting thread's. Together these provide the
-	 * potential for a deadlock, which we attempt to avoid in what follows.
-	 */
+	for (i = 0; i < n_pfns; i++) {
+		u64 map_vaddr = vaddr + ((u64)i << PAGE_SHIFT);
 
-	ret = xpmem_seg_down_read(seg_tg, seg, 1, 0);
-	if (ret == -EAGAIN) {
-		/* to avoid possible deadlock drop current->mm->mmap_sem/mmap_lock */
-		xpmem_mmap_read_unlock(current->mm);
-		ret = xpmem_seg_down_read(seg_tg, seg, 1, 1);
-		xpmem_mmap_read_lock(current->mm);
-		vma_verification_needed = 1;
-	}
-	if (ret != 0)
-		goto out_1;
+		pfn = pfns[i];
+		if (!pfn_valid(pfn))
+			continue;
 
-	if (seg_tg->mm != current->mm) {
-		/*
-		 * Lock the seg's thread group's mmap_sem/mmap_lock in a deadlock
-		 * safe manner. Get the locks in a consistent order by
-		 * getting the smaller address first.
-		 */
-		if (current->mm < seg_tg->mm) {
-			xpmem_mmap_read_lock(seg_tg->mm);
-		} else if (!xpmem_mmap_read_trylock(seg_tg->mm)) {
-			xpmem_mmap_read_unlock(current->mm);
-			xpmem_mmap_read_lock(seg_tg->mm);
-			xpmem_mmap_read_lock(current->mm);
-			vma_verification_needed = 1;
+		old_pfn = xpmem_vaddr_to_PFN(vma->vm_mm, map_vaddr);
+		if (old_pfn) {
+			if (old_pfn == pfn) {
+				if (i == 0)
+					ret = 0;
+			} else {
+				/* should not be possible, but just in case */
+				printk("xpmem_map_pfns: pfn mismatch: "
+				       "%ld != %ld\n", old_pfn, pfn);
+			}
+
+			if (seg)
+				xpmem_release_pfns(seg, pfn, 1);
+			continue;
+		}
+
+		XPMEM_DEBUG("inserting pfn vaddr=%llx, pfn=%lx", map_vaddr, pfn);
+		if (xpmem_insert_pfn(vma, map_vaddr, pfn) == 0) {
+			if (i == 0)
+				ret = 0;
+		} else if (seg) {
+			xpmem_release_pfns(seg, pfn, 1);
 		}
-		seg_tg_mmap_sem_locked = 1;
 	}
 
-	/* verify vma hasn't changed due to dropping current->mm->mmap_sem/mmap_lock */
-	if (vma_verification_needed) {
-		struct vm_area_struct *retry_vma;
-
-		retry_vma = find_vma(current->mm, vaddr);
-		if (!retry_vma ||
-		    retry_vma->vm_start > vaddr ||
-		    !xpmem_is_vm_ops_set(retry_vma) ||
-		    retry_vma->vm_private_data != att)
-			goto out_2;
+	return ret;
+}
+
+/*
+ * Wait for faults that checked XPMEM_FLAG_DESTROYING before it was set to
+ * finish mapping, so that unpinning the attachment afterwards cannot miss
+ * their pages. Detaching holds the mmap_lock for writing, but faults that
+ * run under the vma lock are not excluded by it. They test the flag with
+ * their range's fault lock held.
+ */
+static void
+xpmem_att_fault_barrier(struct xpmem_attachment *att)
+{
+	int i;
+
+	for (i = 0; i < XPMEM_ATT_FAULT_LOCKS; i++) {
+		mutex_lock(&att->fault_mutex[i]);
+		mutex_unlock(&att->fault_mutex[i]);
 	}
+}
 
-	if (mutex_lock_killable(&att->mutex))
-		goto out_2;
-        att_locked = 1;
+#ifdef XPMEM_HAVE_HMM
+/*
+ * XPMEM_ATTACH_NOPIN attachments map source pages without holding references
+ * on them, leaving the source free to migrate, compact or collapse its
+ * memory. Each such attachment has an interval notifier on its source range
+ * that zaps the affected part of the attachment on every invalidation, no
+ * matter which task caused it. Faults look the pages up with
+ * hmm_range_fault() and only install them if no invalidation ran in the
+ * meantime, which is decided under att->invalidate_mutex.
+ */
+static bool
+xpmem_att_invalidate(struct mmu_interval_notifier *mni,
+		     const struct mmu_notifier_range *range,
+		     unsigned long cur_seq)
+{
+	struct xpmem_attachment *att;
+	u64 src_vaddr, start, end;
 
-	if ((att->flags & XPMEM_FLAG_DESTROYING) ||
-	    (ap_tg->flags & XPMEM_FLAG_DESTROYING) ||
-	    (seg_tg->flags & XPMEM_FLAG_DESTROYING))
-		goto out_2;
+	att = container_of(mni, struct xpmem_attachment, notifier);
 
-	if (vaddr < att->at_vaddr || vaddr + 1 > att->at_vaddr + att->at_size)
-		goto out_2;
+	/* zapping may sleep */
+	if (!mmu_notifier_range_blockable(range))
+		return false;
 
-	/* translate the fault virtual address to the source virtual address */
-	seg_vaddr = (att->vaddr & PAGE_MASK) + (vaddr - att->at_vaddr);
-	XPMEM_DEBUG("vaddr = %llx, seg_vaddr = %llx", vaddr, seg_vaddr);
+	mutex_lock(&att->invalidate_mutex);
+	mmu_interval_set_seq(mni, cur_seq);
+
+	/* translate the source range to the attachment */
+	src_vaddr = att->vaddr & PAGE_MASK;
+	start = max_t(u64, range->start, src_vaddr);
+	end = min_t(u64, range->end, src_vaddr + att->at_size);
+	if (!xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING) && start < end)
+		xpmem_zap_ptes(att->at_vma,
+			       att->at_vaddr + (start - src_vaddr),
+			       end - start);
+	else
+		end = start;
 
-        ret = xpmem_ensure_valid_PFN(seg, seg_vaddr, &pfn);
-        if (ret != 0)
-		goto out_2;
+	mutex_unlock(&att->invalidate_mutex);
+
+	if (start < end)
+		xpmem_att_invalidate_reexports(att,
+				att->at_vaddr + (start - src_vaddr),
+				end - start);
+	return true;
+}
+
+static const struct mmu_interval_notifier_ops xpmem_att_interval_ops = {
+	.invalidate	= xpmem_att_invalidate,
+};
+
+static int
+xpmem_prealloc_pte(pte_t *pte, unsigned long addr, void *data)
+{
+	return 0;
+}
+
+/*
+ * Map up to nr_pages source pages starting at seg_vaddr into the
+ * XPMEM_ATTACH_NOPIN attachment at vaddr. If part of the window is missing
+ * from the source, only the first page is tried. The caller holds the
+ * source's mmap_sem/mmap_lock and the fault lock of the range. Returns the
+ * number of pages mapped or a negative errno.
+ */
+static int
+xpmem_map_nopin(struct xpmem_attachment *att, struct vm_area_struct *vma,
+		u64 vaddr, u64 seg_vaddr, int nr_pages, int write)
+{
+	unsigned long pfns[XPMEM_FAULT_AROUND_MAX];
+	struct hmm_range range = {
+		.notifier	= &att->notifier,
+		.start		= seg_vaddr,
+		.end		= seg_vaddr + ((u64)nr_pages << PAGE_SHIFT),
+		.hmm_pfns	= pfns,
+		.default_flags	= HMM_PFN_REQ_FAULT |
+				  (write ? HMM_PFN_REQ_WRITE : 0),
+	};
+	int i, ret;
+
+	DBUG_ON(nr_pages <= 0 || nr_pages > XPMEM_FAULT_AROUND_MAX);
+
+	/*
+	 * The PFNs are inserted under att->invalidate_mutex, which reclaim may
+	 * need to get into xpmem_att_invalidate(). So allocate the page tables
+	 * for the window now, leaving nothing to allocate once it is held.
+	 * They stay around since the caller holds the vma or mmap_lock.
+	 */
+	ret = apply_to_page_range(vma->vm_mm, vaddr,
+				  (u64)nr_pages << PAGE_SHIFT,
+				  xpmem_prealloc_pte, NULL);
+	if (ret != 0)
+		return ret;
+
+again:
+	range.notifier_seq = mmu_interval_read_begin(&att->notifier);
+	ret = hmm_range_fault(&range);
+	if (ret == -EBUSY)
+		goto again;
+	if (ret == -EFAULT && nr_pages > 1) {
+		nr_pages = 1;
+		range.end = seg_vaddr + PAGE_SIZE;
+		goto again;
+	}
+	if (ret != 0)
+		return ret;
+
+	mutex_lock(&att->invalidate_mutex);
+	if (mmu_interval_read_retry(&att->notifier, range.notifier_seq)) {
+		mutex_unlock(&att->invalidate_mutex);
+		goto again;
+	}
+
+	for (i = 0; i < nr_pages; i++)
+		pfns[i] = page_to_pfn(hmm_pfn_to_page(pfns[i]));
+	ret = xpmem_map_pfns(vma, NULL, vaddr, pfns, nr_pages);
+	mutex_unlock(&att->invalidate_mutex);
+
+	return (ret == 0) ? nr_pages : ret;
+}
+
+/*
+ * Stop tracking the source range of a XPMEM_ATTACH_NOPIN attachment. The
+ * caller has made sure no new PTEs can show up in the attachment.
+ */
+static void
+xpmem_att_nopin_remove(struct xpmem_attachment *att)
+{
+	if (att->notifier.mm != NULL)
+		mmu_interval_notifier_remove(&att->notifier);
+}
+#else
+static int
+xpmem_map_nopin(struct xpmem_attachment *att, struct vm_area_struct *vma,
+		u64 vaddr, u64 seg_vaddr, int nr_pages, int write)
+{
+	return -EOPNOTSUPP;
+}
+
+static void
+xpmem_att_nopin_remove(struct xpmem_attachment *att)
+{
+}
+#endif
+
+/*
+ * Map up to nr_pages pages of a XPMEM_MAKE_PIN segment starting at seg_vaddr
+ * into the attachment at vaddr. The segment holds the only references to
+ * its pages. Pages of sealed segments are mapped from their copies on node
+ * nid unless it is NUMA_NO_NODE. The caller holds the fault lock of the
+ * range. Returns the number of pages mapped or a negative errno.
+ */
+static int
+xpmem_map_prepinned(struct vm_area_struct *vma, struct xpmem_segment *seg,
+		    u64 vaddr, u64 seg_vaddr, int nr_pages, int nid)
+{
+	unsigned long pfns[XPMEM_FAULT_AROUND_MAX];
+	int ret;
+
+	nr_pages = xpmem_seg_lookup_PFNs(seg, seg_vaddr, nr_pages, pfns);
+	if (nr_pages <= 0)
+		return -ENOENT;
+
+	if (nid != NUMA_NO_NODE && (seg->flags & XPMEM_FLAG_SEALED))
+		xpmem_seg_replicate_PFNs(seg, seg_vaddr, nr_pages, pfns, nid);
+
+	ret = xpmem_map_pfns(vma, NULL, vaddr, pfns, nr_pages);
+	return (ret == 0) ? nr_pages : ret;
+}
+
+/*
+ * The node whose copies of the segment's pages a fault or populate on behalf
+ * of a thread on node nid maps into att, or NUMA_NO_NODE to map the pages
+ * themselves.
+ */
+static inline int
+xpmem_att_replica_nid(struct xpmem_attachment *att, int nid)
+{
+	return (att->attach_flags & XPMEM_ATTACH_REPLICATE) ? nid :
+							      NUMA_NO_NODE;
+}
+
+/*
+ * Number of source PMD ranges att spans, which is the size of att->placed.
+ */
+static inline unsigned long
+xpmem_att_nr_pmds(struct xpmem_attachment *att)
+{
+	u64 start = att->vaddr & PAGE_MASK;
+
+	return ((start + att->at_size - 1) >> PMD_SHIFT) -
+	       (start >> PMD_SHIFT) + 1;
+}
+
+/*
+ * Whether any of att's PMD ranges that overlap nr_pages at seg_vaddr still
+ * has to be placed by xpmem_att_place_pages().
+ */
+static int
+xpmem_att_needs_placing(struct xpmem_attachment *att, u64 seg_vaddr,
+			int nr_pages)
+{
+	u64 start = att->vaddr & PAGE_MASK;
+	u64 vaddr, last = seg_vaddr + ((u64)nr_pages << PAGE_SHIFT);
+
+	if (att->placed == NULL)
+		return 0;
+
+	for (vaddr = seg_vaddr & PMD_MASK; vaddr < last; vaddr += PMD_SIZE) {
+		if (!test_bit((vaddr >> PMD_SHIFT) - (start >> PMD_SHIFT),
+			      att->placed))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Place the source pages of att's PMD ranges that overlap nr_pages at
+ * seg_vaddr, see xpmem_place_pages(). Each range is only placed by the first
+ * fault or populate to touch it, which waits for the pages to be allocated
+ * with no mmap_sem/mmap_lock held; later faults on the range don't wait for
+ * anything.
+ */
+static void
+xpmem_att_place_pages(struct xpmem_attachment *att, u64 seg_vaddr,
+		      int nr_pages, int write)
+{
+	u64 start = att->vaddr & PAGE_MASK, end = start + att->at_size;
+	u64 vaddr, from, next, last = seg_vaddr + ((u64)nr_pages << PAGE_SHIFT);
+	unsigned long idx;
+
+	if (att->placed == NULL)
+		return;
+
+	for (vaddr = seg_vaddr; vaddr < last; vaddr = next) {
+		from = max_t(u64, vaddr & PMD_MASK, start);
+		next = min_t(u64, (vaddr & PMD_MASK) + PMD_SIZE, end);
+		idx = (vaddr >> PMD_SHIFT) - (start >> PMD_SHIFT);
+		if (test_bit(idx, att->placed) ||
+		    test_and_set_bit(idx, att->placed))
+			continue;
+
+		xpmem_place_pages(att->ap->seg, att->place, from,
+				  (next - from) >> PAGE_SHIFT, write);
+	}
+}
+
+/*
+ * Whether every page mapped into att holds a reference of its own that is
+ * dropped when the page is unmapped.
+ */
+static inline int
+xpmem_att_pins_pages(struct xpmem_attachment *att)
+{
+	return !(att->attach_flags & XPMEM_ATTACH_NOPIN) &&
+	       !(att->ap->seg->make_flags & XPMEM_MAKE_PIN);
+}
+
+/*
+ * Release the pages mapped by an attachment that is being detached. Pinned
+ * pages are unpinned. The PTEs of attachments that don't pin are zapped
+ * instead, before the notifier of XPMEM_ATTACH_NOPIN attachments that keeps
+ * them coherent goes away.
+ */
+static void
+xpmem_att_unmap_pages(struct xpmem_attachment *att, struct vm_area_struct *vma)
+{
+	if (!xpmem_att_pins_pages(att)) {
+		xpmem_zap_ptes(vma, att->at_vaddr, att->at_size);
+		xpmem_att_nopin_remove(att);
+	} else {
+		xpmem_unpin_pages(att->ap->seg, vma->vm_mm, att->at_vaddr,
+				  att->at_size);
+	}
+
+	xpmem_att_invalidate_reexports(att, att->at_vaddr, att->at_size);
+}
+
+#ifdef XPMEM_HAVE_HUGE_FAULT
+/*
+ * Install a PMD or PUD sized mapping of the pinned huge source page starting
+ * at pfn. The caller holds the fault lock of the range so no other XPMEM
+ * fault can populate the entry concurrently. If the entry was already
+ * populated the pins are dropped.
+ */
+static vm_fault_t
+xpmem_insert_huge_pfn(struct vm_fault *vmf, struct xpmem_segment *seg,
+		      unsigned int order, unsigned long pfn)
+{
+	bool write = !!(vmf->flags & FAULT_FLAG_WRITE);
+	/* like base pages, not devmap: these are not ZONE_DEVICE pages */
+	pfn_t entry = __pfn_to_pfn_t(pfn, PFN_DEV);
+	vm_fault_t ret = VM_FAULT_FALLBACK;
+	int inserted = 0;
+
+	if (order == PMD_SHIFT - PAGE_SHIFT) {
+		if (pmd_none(*vmf->pmd)) {
+			ret = vmf_insert_pfn_pmd(vmf, entry, write);
+			inserted = (ret == VM_FAULT_NOPAGE);
+		} else if (pmd_trans_huge(*vmf->pmd) || pmd_devmap(*vmf->pmd)) {
+			ret = VM_FAULT_NOPAGE;
+		}
+	}
+#ifdef CONFIG_HAVE_ARCH_TRANSPARENT_HUGEPAGE_PUD
+	else if (order == PUD_SHIFT - PAGE_SHIFT) {
+		if (pud_none(*vmf->pud)) {
+			ret = vmf_insert_pfn_pud(vmf, entry, write);
+			/*
+			 * Base page and PMD faults lock a different range
+			 * than PUD faults, so one of them may have populated
+			 * the pud first. Check that our entry is the one
+			 * that got installed.
+			 */
+			inserted = (ret == VM_FAULT_NOPAGE &&
+				    (pud_trans_huge(*vmf->pud) ||
+				     pud_devmap(*vmf->pud)) &&
+				    pud_pfn(*vmf->pud) == pfn);
+		} else if (pud_trans_huge(*vmf->pud) || pud_devmap(*vmf->pud)) {
+			ret = VM_FAULT_NOPAGE;
+		}
+	}
+#endif
+
+	if (!inserted)
+		xpmem_release_pfns(seg, pfn, 1UL << order);
+
+	XPMEM_DEBUG("huge mapping order=%u, pfn=%lx, inserted=%d", order, pfn,
+		    inserted);
+	return ret;
+}
+#endif /* XPMEM_HAVE_HUGE_FAULT */
+
+/*
+ * Take the references xpmem_fault() needs before it drops current->mm's
+ * mmap_sem/mmap_lock. They are dropped again at the end of the fault.
+ */
+static inline void
+xpmem_fault_hold_refs(struct xpmem_attachment *att, int *refs_held)
+{
+	if (*refs_held)
+		return;
+
+	xpmem_att_ref(att);
+	xpmem_seg_ref(att->ap->seg);
+	xpmem_tg_ref(att->ap->seg->tg);
+	*refs_held = 1;
+}
+
+/*
+ * Reasons for xpmem_fault() to return VM_FAULT_RETRY.
+ */
+#define XPMEM_FAULT_RETRY_SEG		1	/* seg sema is contended */
+#define XPMEM_FAULT_RETRY_SRC_MM	2	/* source mmap_lock is contended */
+#define XPMEM_FAULT_RETRY_SRC_MAP	3	/* source range is not mapped yet */
+#define XPMEM_FAULT_RETRY_MIGRATE	4	/* source range is being migrated */
+#define XPMEM_FAULT_RETRY_PLACE		5	/* source range has to be placed */
+
+/*
+ * Whether a fault may return VM_FAULT_RETRY rather than sleep on a lock with
+ * the consumer's mmap_lock held. Only the first attempt is retried so a
+ * fault always makes progress. Faults under the vma lock can always be
+ * retried since the kernel falls back to taking the mmap_lock.
+ */
+static inline int
+xpmem_fault_may_retry(struct vm_fault *vmf)
+{
+	if (xpmem_fault_vma_locked(vmf))
+		return 1;
+
+	return ((vmf->flags & FAULT_FLAG_ALLOW_RETRY) &&
+		!(vmf->flags & FAULT_FLAG_TRIED));
+}
+
+/*
+ * Check that vaddr is still covered by att's vma after a fault had to drop
+ * current->mm's mmap_sem/mmap_lock.
+ */
+static int
+xpmem_fault_vma_valid(struct xpmem_attachment *att, u64 vaddr)
+{
+	struct vm_area_struct *vma;
+
+	vma = find_vma(current->mm, vaddr);
+	return (vma && vma->vm_start <= vaddr && xpmem_is_vm_ops_set(vma) &&
+		vma->vm_private_data == att &&
+		vaddr >= att->at_vaddr && vaddr < att->at_vaddr + att->at_size);
+}
+
+/*
+ * Whether a fault on att has to wait for the source to map seg_vaddr, which
+ * is the case for XPMEM_ATTACH_WAIT attachments when no vma covers it yet.
+ * The caller holds mm's mmap_sem/mmap_lock.
+ */
+static int
+xpmem_fault_src_missing(struct xpmem_attachment *att, struct mm_struct *mm,
+			u64 seg_vaddr)
+{
+	struct vm_area_struct *vma;
+
+	if (!(att->attach_flags & XPMEM_ATTACH_WAIT))
+		return 0;
+
+	vma = find_vma(mm, seg_vaddr);
+	return (!vma || vma->vm_start > seg_vaddr);
+}
+
+/*
+ * Wait up to attach_wait_ms for the source of seg to map seg_vaddr. Mapping
+ * memory raises no event XPMEM could wait on, so the source's address space
+ * is polled, backing off up to XPMEM_WAIT_POLL_MAX. Returns 0 once the
+ * address is mapped, or -ETIMEDOUT, -EINTR or -ENOENT if the segment went
+ * away.
+ */
+#define XPMEM_WAIT_POLL_MAX	max_t(long, 1, HZ / 50)
+
+static int
+xpmem_fault_wait_src(struct xpmem_segment *seg, u64 seg_vaddr)
+{
+	struct xpmem_thread_group *seg_tg = seg->tg;
+	struct mm_struct *mm = seg_tg->mm;
+	unsigned long deadline;
+	long delay = 1;
+	int missing;
+
+	deadline = jiffies + msecs_to_jiffies(xpmem_attach_wait_ms);
+	for (;;) {
+		schedule_timeout_killable(delay);
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		delay = min_t(long, delay * 2, XPMEM_WAIT_POLL_MAX);
+
+		if ((seg->flags & XPMEM_FLAG_DESTROYING) ||
+		    (seg_tg->flags & XPMEM_FLAG_DESTROYING) ||
+		    !mmget_not_zero(mm))
+			return -ENOENT;
+		xpmem_mmap_read_lock(mm);
+		missing = !find_vma_intersection(mm, seg_vaddr, seg_vaddr + 1);
+		xpmem_mmap_read_unlock(mm);
+		mmput(mm);
+
+		if (!missing)
+			return 0;
+		if (time_after_eq(jiffies, deadline))
+			return -ETIMEDOUT;
+	}
+}
+
+/*
+ * Get ready to look up source pages to pin and map into att, and return the
+ * invalidation sequence of att's segment to pass to
+ * xpmem_fault_mapped_stale() once they are mapped. att is marked as mapped
+ * first, so that the MMU notifier either finds it and bumps the sequence or
+ * ran before the source PTEs are read. A detach that started meanwhile does
+ * not see the mark, so it is taken back.
+ */
+static unsigned int
+xpmem_att_invalidate_begin(struct xpmem_attachment *att)
+{
+	unsigned int seq;
+
+	xpmem_att_set_validPTEs(att);
+	smp_mb();	/* pairs with xpmem_invalidate_range() */
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING))
+		xpmem_att_clear_validPTEs(att);
+	seq = atomic_read(&att->ap->seg->invalidate_seq);
+	smp_rmb();	/* read the sequence before the source's PTEs */
+	return seq;
+}
+
+/*
+ * Check whether the source's MMU notifier cleared att's part of the segment
+ * since seq was read by xpmem_att_invalidate_begin(), after the pinned pages
+ * at [vaddr, vaddr + size) of att were looked up and mapped. If so, the
+ * notifier may have come and gone before they were mapped, so unmap and
+ * unpin them again and return 1;
+ * the fault is simply taken again. Unlike the mmu_interval_read_retry()
+ * pattern, the pages are mapped before the check rather than under the
+ * notifier's lock, since mapping them may allocate page tables and reclaim
+ * may end up in the notifier. An invalidation that ran before seq was read
+ * may have unmarked att as mapped after that, so it is marked again. The
+ * caller holds the fault lock of the range.
+ */
+static int
+xpmem_fault_mapped_stale(struct xpmem_attachment *att, u64 vaddr, u64 size,
+			 unsigned int seq)
+{
+	struct xpmem_segment *seg = att->ap->seg;
+	u64 seg_vaddr = (att->vaddr & PAGE_MASK) + (vaddr - att->at_vaddr);
+	u64 unpin_at = 0, invalidate_len = 0;
+
+	mutex_lock(&att->invalidate_mutex);
+	smp_mb();	/* pairs with xpmem_invalidate_range() */
+	if (atomic_read(&seg->invalidate_seq) == seq) {
+		if (!xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING))
+			xpmem_att_set_validPTEs(att);
+		mutex_unlock(&att->invalidate_mutex);
+		return 0;
+	}
+	if (!xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING))
+		invalidate_len = xpmem_clear_PTEs_of_att_locked(att, seg_vaddr,
+						seg_vaddr + size, 1, &unpin_at);
+	mutex_unlock(&att->invalidate_mutex);
+
+	if (invalidate_len)
+		xpmem_att_invalidate_reexports(att, unpin_at, invalidate_len);
+	return 1;
+}
+
+/*
+ * Common attachment fault path. order is 0 for a base page fault, in which
+ * case a fault-around window of base pages is mapped, or the order of a PMD
+ * or PUD sized fault, in which case VM_FAULT_FALLBACK is returned whenever a
+ * huge mapping cannot be established.
+ */
+static vm_fault_t
+xpmem_fault(struct vm_area_struct *vma, struct vm_fault *vmf, u64 vaddr,
+	    unsigned int order)
+{
+	vm_fault_t ret;
+	struct mutex *fault_lock = NULL;
+	int seg_tg_mmap_sem_locked = 0, vma_verification_needed = 0;
+	int seg_locked = 0, refs_held = 0;
+	u64 seg_vaddr;
+	unsigned long pfns[XPMEM_FAULT_AROUND_MAX];
+#ifdef XPMEM_HAVE_HUGE_FAULT
+	unsigned long pfn = 0;
+#endif
+	int i, window = 0, n_pfns = 0, retry = 0, write, nopin, prepinned;
+	int mapped = 0, refault = 0, wait_src = 0, wait_migrate = 0;
+	unsigned int inval_seq = 0;
+	struct xpmem_thread_group *ap_tg, *seg_tg;
+	struct xpmem_access_permit *ap;
+	struct xpmem_attachment *att;
+	struct xpmem_segment *seg;
+
+	if (current->flags & PF_DUMPCORE)
+		return VM_FAULT_SIGBUS;
+
+	att = (struct xpmem_attachment *)vma->vm_private_data;
+	if (att == NULL) {
+		/*
+		 * Users who effectively bypass xpmem_attach() by opening
+		 * and mapping /dev/xpmem will have a NULL finfo and will
+		 * be killed here.
+		 */
+		return VM_FAULT_SIGBUS;
+	}
+
+	/*
+	 * No references are taken while current->mm's mmap_sem/mmap_lock is
+	 * held: att stays linked to the vma until a detach, which needs the
+	 * lock for writing, and att's ap keeps the seg and both thread groups
+	 * alive until all of its atts are detached. Taking references on
+	 * every fault would bounce their refcnt cachelines between all of the
+	 * CPUs faulting on the segment. xpmem_fault_hold_refs() takes them
+	 * only when the lock has to be dropped.
+	 */
+	ap = att->ap;
+	ap_tg = ap->tg;
+	if ((ap->flags & XPMEM_FLAG_DESTROYING) ||
+	    (ap_tg->flags & XPMEM_FLAG_DESTROYING))
+		return VM_FAULT_SIGBUS;
+	DBUG_ON(current->tgid != ap_tg->tgid);
+	DBUG_ON(ap->mode != XPMEM_RDWR &&
+		!(att->attach_flags & XPMEM_ATTACH_RDONLY));
+	write = !(att->attach_flags & XPMEM_ATTACH_RDONLY);
+	nopin = !!(att->attach_flags & XPMEM_ATTACH_NOPIN);
+
+	seg = ap->seg;
+	seg_tg = seg->tg;
+
+	/*
+	 * Sealed segments stay pinned and are never recalled. Faults on them
+	 * only have to keep out xpmem_remove_seg(), which waits for the fault
+	 * locks, so they skip seg->sema and the lock juggling below.
+	 */
+	prepinned = !!(seg->flags & XPMEM_FLAG_SEALED);
+	if (prepinned) {
+		smp_rmb();
+		goto sealed;
+	}
+
+	/*
+	 * The faulting thread has its mmap_sem/mmap_lock locked on entrance to this
+	 * fault handler. In order to supply the missing page we will need
+	 * to get access to the segment that has it, as well as lock the
+	 * mmap_sem/mmap_lock of the thread group that owns the segment should it be
+	 * different from the faulting thread's. Together these provide the
+	 * potential for a deadlock, which we attempt to avoid in what follows.
+	 */
+
+	ret = xpmem_seg_down_read(seg_tg, seg, 1, 0);
+	if (ret == -EAGAIN && xpmem_fault_may_retry(vmf)) {
+		retry = XPMEM_FAULT_RETRY_SEG;
+		goto out_retry;
+	} else if (ret == -EAGAIN) {
+		/* to avoid possible deadlock drop current->mm->mmap_sem/mmap_lock */
+		xpmem_fault_hold_refs(att, &refs_held);
+		xpmem_mmap_read_unlock(current->mm);
+		ret = xpmem_seg_down_read(seg_tg, seg, 1, 1);
+		xpmem_mmap_read_lock(current->mm);
+		vma_verification_needed = 1;
+	}
+	if (ret != 0)
+		goto out_1;
+	seg_locked = 1;
+
+	if (vma_verification_needed && !xpmem_fault_vma_valid(att, vaddr))
+		goto out_1;
+	vma_verification_needed = 0;
+
+	/* xpmem_seal() may have pinned the segment while we waited */
+	prepinned = !!(seg->make_flags & XPMEM_MAKE_PIN);
+
+sealed:
+	if (vaddr < att->at_vaddr || vaddr + 1 > att->at_vaddr + att->at_size)
+		goto out_1;
+
+	/* translate the fault virtual address to the source virtual address */
+	seg_vaddr = (att->vaddr & PAGE_MASK) + (vaddr - att->at_vaddr);
+	XPMEM_DEBUG("vaddr = %llx, seg_vaddr = %llx", vaddr, seg_vaddr);
+
+	/*
+	 * Source pages that are already present are pinned without the source's
+	 * mmap_sem/mmap_lock, so faults don't stall behind a producer thread
+	 * that is mapping or unmapping memory, and don't need the lock ordering
+	 * below. Whatever is pinned here or below is checked against the
+	 * invalidations that ran in the meantime once it is mapped.
+	 */
+	if (!nopin && !prepinned)
+		inval_seq = xpmem_att_invalidate_begin(att);
+	if (!order) {
+		window = xpmem_fault_around_size(att, vma, vaddr);
+		if (!nopin && !prepinned)
+			n_pfns = xpmem_ensure_valid_PFNs_fast(seg, seg_vaddr,
+							      window, pfns,
+							      write);
+	}
+
+	/*
+	 * Get source pages that still have to be allocated placed first. That
+	 * waits for a worker on the target node, which must not happen with
+	 * the consumer's lock held, so the fault is retried once it is done.
+	 * Faults that can't wait leave the range to a later one.
+	 */
+	if (n_pfns == 0 && !prepinned && !order && seg_tg->mm != current->mm &&
+	    xpmem_att_needs_placing(att, seg_vaddr, window) &&
+	    xpmem_fault_may_retry(vmf) &&
+	    !(vmf->flags & FAULT_FLAG_RETRY_NOWAIT)) {
+		retry = XPMEM_FAULT_RETRY_PLACE;
+		goto out_retry;
+	}
+
+	if (n_pfns == 0 && !prepinned &&
+	    (seg_tg->mm != current->mm || xpmem_fault_vma_locked(vmf))) {
+		/*
+		 * Lock the seg's thread group's mmap_sem/mmap_lock in a deadlock
+		 * safe manner. Get the locks in a consistent order by
+		 * getting the smaller address first. Faults holding only the
+		 * vma lock have no order to follow, so they never sleep here.
+		 * They also need the lock when attached to their own mm.
+		 */
+		if (xpmem_mmap_read_trylock(seg_tg->mm)) {
+			/* uncontended */
+		} else if (!xpmem_fault_vma_locked(vmf) &&
+			   current->mm < seg_tg->mm) {
+			xpmem_mmap_read_lock(seg_tg->mm);
+		} else if (xpmem_fault_may_retry(vmf)) {
+			retry = XPMEM_FAULT_RETRY_SRC_MM;
+			goto out_retry;
+		} else {
+			xpmem_fault_hold_refs(att, &refs_held);
+			xpmem_mmap_read_unlock(current->mm);
+			xpmem_mmap_read_lock(seg_tg->mm);
+			xpmem_mmap_read_lock(current->mm);
+			vma_verification_needed = 1;
+		}
+		seg_tg_mmap_sem_locked = 1;
+	}
+
+	/* verify vma hasn't changed due to dropping current->mm->mmap_sem/mmap_lock */
+	if (vma_verification_needed && !xpmem_fault_vma_valid(att, vaddr))
+		goto out_1;
+
+	fault_lock = xpmem_att_fault_lock(att, vaddr, order);
+	if (mutex_lock_killable(fault_lock)) {
+		fault_lock = NULL;
+		goto out_release;
+	}
+
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING) ||
+	    (ap_tg->flags & XPMEM_FLAG_DESTROYING) ||
+	    (seg->flags & XPMEM_FLAG_DESTROYING) ||
+	    (seg_tg->flags & XPMEM_FLAG_DESTROYING))
+		goto out_release;
+
+	/*
+	 * Pages of pre-pinned segments are looked up rather than pinned. Like
+	 * pin-free attachments, these only map base pages.
+	 */
+	if (prepinned || nopin) {
+		if (!order && prepinned)
+			mapped = xpmem_map_prepinned(vma, seg, vaddr, seg_vaddr,
+					window, xpmem_att_replica_nid(att,
+							numa_node_id()));
+		else if (!order)
+			mapped = xpmem_map_nopin(att, vma, vaddr, seg_vaddr,
+						 window, write);
+		if (mapped <= 0 && nopin && !order)
+			wait_src = xpmem_fault_src_missing(att, seg_tg->mm,
+							   seg_vaddr);
+		if (mapped > 0) {
+			WRITE_ONCE(att->fault_next,
+				   vaddr + ((u64)mapped << PAGE_SHIFT));
+			xpmem_att_set_validPTEs(att);
+		}
+		goto out_1;
+	}
+
+#ifdef XPMEM_HAVE_HUGE_FAULT
+	if (order) {
+		u64 huge_size = PAGE_SIZE << order;
+
+		/* both ends of the mapping must be aligned to the huge size */
+		vaddr &= ~(huge_size - 1);
+		seg_vaddr = (att->vaddr & PAGE_MASK) + (vaddr - att->at_vaddr);
+		if (vaddr < att->at_vaddr || vaddr < vma->vm_start ||
+		    vaddr + huge_size > att->at_vaddr + att->at_size ||
+		    vaddr + huge_size > vma->vm_end ||
+		    (seg_vaddr & (huge_size - 1)) != 0)
+			goto out_1;
+
+		/* ranges of migrating segments are waited for by base faults */
+		if (seg->migrate ||
+		    xpmem_ensure_valid_huge_PFN(seg, seg_vaddr, order, &pfn,
+						write) != 0)
+			goto out_1;
+
+		n_pfns = 1;
+		xpmem_att_set_validPTEs(att);
+		goto out_1;
+	}
+#endif
+
+	/* pin the faulting page along with the fault-around window */
+	if (n_pfns == 0) {
+		n_pfns = xpmem_ensure_valid_PFNs(seg, seg_vaddr, window, pfns,
+						 write);
+		if (n_pfns <= 0) {
+			/* an attachment the source range is made over is busy */
+			refault = (n_pfns == -EAGAIN);
+			if (n_pfns == -ENOENT)
+				wait_src = xpmem_fault_src_missing(att,
+							seg_tg->mm, seg_vaddr);
+			n_pfns = 0;
+			goto out_1;
+		}
+	}
+	if (seg->migrate) {
+		/* don't hold pins on a range migrate_vma_setup() looks at */
+		if (xpmem_migrate_busy(seg, seg_vaddr)) {
+			wait_migrate = refault = 1;
+			goto out_release;
+		}
+		xpmem_migrate_sample(seg, seg_vaddr, pfns[0]);
+	}
+	WRITE_ONCE(att->fault_next, vaddr + ((u64)n_pfns << PAGE_SHIFT));
+
+	xpmem_att_set_validPTEs(att);
+	goto out_1;
+
+out_retry:
+	/*
+	 * Give up the fault instead of sleeping with the consumer's lock held.
+	 * The lock is released here and the wait for whatever was contended
+	 * happens below, once everything else has been dropped.
+	 */
+	if (!(vmf->flags & FAULT_FLAG_RETRY_NOWAIT)) {
+		xpmem_fault_hold_refs(att, &refs_held);
+		xpmem_release_fault_lock(vmf, vma);
+	}
+
+out_release:
+	for (i = 0; i < n_pfns; i++)
+		xpmem_release_pfns(seg, pfns[i], 1);
+	n_pfns = 0;
+out_1:
+	ret = (mapped > 0 || refault) ? VM_FAULT_NOPAGE : VM_FAULT_SIGBUS;
+
+#ifdef XPMEM_HAVE_HUGE_FAULT
+	if (order) {
+		ret = (n_pfns) ? xpmem_insert_huge_pfn(vmf, seg, order, pfn) :
+				 VM_FAULT_FALLBACK;
+		/* a stale mapping is faulted again, just like a fresh one */
+		if (ret == VM_FAULT_NOPAGE && n_pfns)
+			xpmem_fault_mapped_stale(att, vaddr, PAGE_SIZE << order,
+						 inval_seq);
+		n_pfns = 0;
+	}
+#endif
+
+	if (n_pfns) {
+		if (xpmem_map_pfns(vma, seg, vaddr, pfns, n_pfns) == 0)
+			ret = VM_FAULT_NOPAGE;
+		if (xpmem_fault_mapped_stale(att, vaddr,
+					     (u64)n_pfns << PAGE_SHIFT,
+					     inval_seq))
+			ret = VM_FAULT_NOPAGE;
+	}
+
+	if (seg_tg_mmap_sem_locked)
+		xpmem_mmap_read_unlock(seg_tg->mm);
+
+	if (fault_lock)
+		mutex_unlock(fault_lock);
+
+	/*
+	 * The seg stays read-locked until the new PTEs are in place so that
+	 * xpmem_clear_PTEs(), which runs with the seg write-locked, cannot
+	 * miss them now that faults no longer take att->mutex.
+	 */
+	if (seg_locked)
+		xpmem_seg_up_read(seg_tg, seg, 1);
+
+	/*
+	 * A fault that has to wait for the source or for a migration of its
+	 * range gives up the consumer's lock and retries, like one that finds
+	 * a lock contended. If it may not retry, it fails with SIGBUS, or
+	 * faults again right away for a migration.
+	 */
+	if ((wait_src || wait_migrate) && xpmem_fault_may_retry(vmf)) {
+		retry = wait_src ? XPMEM_FAULT_RETRY_SRC_MAP :
+				   XPMEM_FAULT_RETRY_MIGRATE;
+		if (!(vmf->flags & FAULT_FLAG_RETRY_NOWAIT)) {
+			xpmem_fault_hold_refs(att, &refs_held);
+			xpmem_release_fault_lock(vmf, vma);
+		}
+	}
+
+	if (retry) {
+		if (!(vmf->flags & FAULT_FLAG_RETRY_NOWAIT)) {
+			/*
+			 * With nothing held, wait for whatever held up the
+			 * fault so the retried fault can go ahead. Faults under
+			 * the vma lock leave waiting for the source to their
+			 * retry under the mmap_lock.
+			 */
+			if (retry == XPMEM_FAULT_RETRY_SEG) {
+				if (xpmem_seg_down_read(seg_tg, seg, 1, 1) == 0)
+					xpmem_seg_up_read(seg_tg, seg, 1);
+			} else if (retry == XPMEM_FAULT_RETRY_SRC_MM) {
+				xpmem_mmap_read_lock(seg_tg->mm);
+				xpmem_mmap_read_unlock(seg_tg->mm);
+			} else if (retry == XPMEM_FAULT_RETRY_MIGRATE) {
+				xpmem_migrate_wait(seg);
+			} else if (retry == XPMEM_FAULT_RETRY_PLACE) {
+				xpmem_att_place_pages(att, seg_vaddr, window,
+						      write);
+			} else if (!xpmem_fault_vma_locked(vmf)) {
+				xpmem_fault_wait_src(seg, seg_vaddr);
+			}
+		}
+		ret = VM_FAULT_RETRY;
+	}
+
+	if (refs_held) {
+		xpmem_tg_deref(seg_tg);
+		xpmem_seg_deref(seg);
+		xpmem_att_deref(att);
+	}
+
+	if (ret == VM_FAULT_SIGBUS) {
+		XPMEM_DEBUG("fault returning SIGBUS vaddr=%llx", vaddr);
+	}
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+static vm_fault_t
+xpmem_fault_handler(struct vm_fault *vmf)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+int
+xpmem_fault_handler(struct vm_fault *vmf)
+#else
+static int
+xpmem_fault_handler(struct vm_area_struct *vma, struct vm_fault *vmf)
+#endif
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	u64 vaddr = (u64)(uintptr_t) vmf->address;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+        struct vm_area_struct *vma = vmf->vma;
+#endif
+#else
+        u64 vaddr = (u64)(uintptr_t) vmf->virtual_address;
+#endif
+
+	return xpmem_fault(vma, vmf, vaddr, 0);
+}
+
+#ifdef XPMEM_HAVE_HUGE_FAULT
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t
+xpmem_huge_fault_handler(struct vm_fault *vmf, unsigned int order)
+{
+	struct xpmem_attachment *att = vmf->vma->vm_private_data;
+#else
+static vm_fault_t
+xpmem_huge_fault_handler(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+	struct xpmem_attachment *att = vmf->vma->vm_private_data;
+	unsigned int order = 0;
+
+	if (pe_size == PE_SIZE_PMD)
+		order = PMD_SHIFT - PAGE_SHIFT;
+	else if (pe_size == PE_SIZE_PUD)
+		order = PUD_SHIFT - PAGE_SHIFT;
+#endif
+	/* GUP only handles page sized entries of XPMEM_ATTACH_PAGES vmas */
+	if (order == 0 ||
+	    (att && (att->attach_flags & XPMEM_ATTACH_PAGES)))
+		return VM_FAULT_FALLBACK;
+
+	return xpmem_fault(vmf->vma, vmf, vmf->address, order);
+}
+#endif
+
+#ifdef XPMEM_HAVE_VMA_MAP_PAGES
+/*
+ * The kernel only calls ->fault of a vma that is not anonymous under the vma
+ * lock if the vma has ->map_pages as well; otherwise the fault is retried
+ * under the mmap_lock. ->map_pages runs first, under RCU, and cannot sleep,
+ * which pinning source pages needs. xpmem_fault() maps its own fault-around
+ * window, so this maps nothing and only lets base page faults run under the
+ * vma lock.
+ */
+static vm_fault_t
+xpmem_map_pages_handler(struct vm_fault *vmf, pgoff_t start_pgoff,
+			pgoff_t end_pgoff)
+{
+	return 0;
+}
+#endif
+
+struct vm_operations_struct xpmem_vm_ops = {
+	.open = xpmem_open_handler,
+	.close = xpmem_close_handler,
+	.fault = xpmem_fault_handler,
+#ifdef XPMEM_HAVE_HUGE_FAULT
+	.huge_fault = xpmem_huge_fault_handler,
+#endif
+#ifdef XPMEM_HAVE_VMA_MAP_PAGES
+	.map_pages = xpmem_map_pages_handler,
+#endif
+};
+
+/*
+ * This function is called via the Linux kernel mmap() code, which is
+ * instigated by the call to do_mmap() in xpmem_attach().
+ */
+int
+xpmem_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	/*
+	 * When a mapping is related to a file, the file pointer is typically
+	 * stored in vma->vm_file and a fput() is done to it when the VMA is
+	 * unmapped. Since file is of no interest in XPMEM's case, we ensure
+	 * vm_file is empty and do the fput() here.
+	 *
+	 * The exception is when attachments may be mapped with huge PFN
+	 * entries: the kernel only treats huge PFN mappings as special (no
+	 * rmap or refcount to drop when zapping) in vmas that have a file.
+	 * XPMEM_ATTACH_PAGES attachments, recognizable by their offset, need
+	 * the file to be zapped through its mapping.
+	 */
+#ifndef XPMEM_HAVE_HUGE_FAULT
+	if (!xpmem_is_pages_pgoff(vma->vm_pgoff)) {
+		vma->vm_file = NULL;
+		fput(file);
+	}
+#endif
+
+	vma->vm_ops = &xpmem_vm_ops;
+	return 0;
+}
+
+#ifdef XPMEM_HAVE_HUGE_FAULT
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define xpmem_mm_get_unmapped_area(_f, _a, _l, _p, _fl) \
+	mm_get_unmapped_area(current->mm, _f, _a, _l, _p, _fl)
+#else
+#define xpmem_mm_get_unmapped_area(_f, _a, _l, _p, _fl) \
+	current->mm->get_unmapped_area(_f, _a, _l, _p, _fl)
+#endif
+
+/*
+ * Called via vm_mmap() in xpmem_attach(). xpmem_attach() passes the source
+ * address of the attachment as the mmap offset, so when the kernel picks the
+ * address we return one that is congruent to the source address modulo the
+ * largest huge page size that fits. This lets faults on huge source pages be
+ * satisfied with PMD/PUD mappings.
+ */
+unsigned long
+xpmem_get_unmapped_area(struct file *file, unsigned long addr,
+			unsigned long len, unsigned long pgoff,
+			unsigned long flags)
+{
+	unsigned long align = 0, off, ret;
+
+	if (len >= PUD_SIZE)
+		align = PUD_SIZE;
+	else if (len >= PMD_SIZE)
+		align = PMD_SIZE;
+
+	if (!align || addr || (flags & MAP_FIXED) || len + align < len)
+		return xpmem_mm_get_unmapped_area(file, addr, len, pgoff, flags);
+
+	ret = xpmem_mm_get_unmapped_area(file, 0, len + align, pgoff, flags);
+	if (IS_ERR_VALUE(ret))
+		return ret;
+
+	off = (pgoff << PAGE_SHIFT) & (align - 1);
+	ret += (off - ret) & (align - 1);
+	return ret;
+}
+#endif /* XPMEM_HAVE_HUGE_FAULT */
+
+/*
+ * Pin up to nr_pages pages at vaddr of the attachment vma, for a segment that
+ * the thread group owning the attachment made over it. The pages are first
+ * mapped into the attachment the way a fault would, then pinned from its
+ * PTEs. This way the attachment's own invalidations, which clear its PTEs,
+ * reach the consumers of the segment made over it (see
+ * xpmem_att_invalidate_reexports()).
+ *
+ * The caller holds vma->vm_mm's mmap_sem/mmap_lock and the segment made over
+ * the attachment, so the locks of the attachment's segment are only tried.
+ * -EAGAIN is returned if one of them is contended and -ELOOP if the chain of
+ * attachments loops or is longer than XPMEM_MAX_CHAIN.
+ */
+int
+xpmem_pin_attached(struct vm_area_struct *vma, u64 vaddr, int nr_pages,
+		   unsigned long *pfns, int write, struct xpmem_chain *chain)
+{
+	struct xpmem_attachment *att = vma->vm_private_data;
+	struct xpmem_chain link = { .prev = chain, .att = att };
+	struct xpmem_segment *seg;
+	struct xpmem_thread_group *seg_tg;
+	struct mutex *fault_lock;
+	unsigned long pfn;
+	unsigned int inval_seq;
+	u64 seg_vaddr;
+	int i, depth = 1, ret;
+
+	if (att == NULL)
+		return -ENOENT;
+
+	for (; chain != NULL; chain = chain->prev) {
+		if (chain->att == att || ++depth > XPMEM_MAX_CHAIN)
+			return -ELOOP;
+	}
+
+	seg = att->ap->seg;
+	seg_tg = seg->tg;
+	write = write && !(att->attach_flags & XPMEM_ATTACH_RDONLY);
+
+	/* stay within the range of a single fault lock */
+	nr_pages = min_t(u64, nr_pages,
+			 ((vaddr & PMD_MASK) + PMD_SIZE - vaddr) >> PAGE_SHIFT);
+
+	ret = xpmem_seg_down_read(seg_tg, seg, 1, 0);
+	if (ret != 0)
+		return ret;
+
+	ret = -EAGAIN;
+	if (seg_tg->mm != vma->vm_mm && !xpmem_mmap_read_trylock(seg_tg->mm))
+		goto out_1;
+
+	fault_lock = xpmem_att_fault_lock(att, vaddr, 0);
+	if (!mutex_trylock(fault_lock))
+		goto out_2;
+
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING) ||
+	    (seg->flags & XPMEM_FLAG_DESTROYING)) {
+		ret = -ENOENT;
+		goto out_3;
+	}
+
+	seg_vaddr = (att->vaddr & PAGE_MASK) + (vaddr - att->at_vaddr);
+	if (seg->make_flags & XPMEM_MAKE_PIN) {
+		ret = xpmem_map_prepinned(vma, seg, vaddr, seg_vaddr, nr_pages,
+				xpmem_att_replica_nid(att, numa_node_id()));
+	} else if (att->attach_flags & XPMEM_ATTACH_NOPIN) {
+		ret = xpmem_map_nopin(att, vma, vaddr, seg_vaddr, nr_pages,
+				      write);
+	} else {
+		inval_seq = xpmem_att_invalidate_begin(att);
+		ret = xpmem_ensure_valid_PFNs_chained(seg, seg_vaddr, nr_pages,
+						      pfns, write, &link);
+		if (ret > 0) {
+			xpmem_map_pfns(vma, seg, vaddr, pfns, ret);
+			if (xpmem_fault_mapped_stale(att, vaddr,
+						     (u64)ret << PAGE_SHIFT,
+						     inval_seq)) {
+				ret = -EAGAIN;
+				goto out_3;
+			}
+		}
+	}
+	if (ret > 0)
+		xpmem_att_set_validPTEs(att);
+
+	/* take the references of the caller from what is mapped now */
+	for (i = 0; i < nr_pages; i++) {
+		pfn = xpmem_vaddr_to_PFN(vma->vm_mm,
+					 vaddr + ((u64)i << PAGE_SHIFT));
+		if (!pfn || !pfn_valid(pfn))
+			break;
+		get_page(pfn_to_page(pfn));
+		pfns[i] = pfn;
+	}
+	if (i > 0)
+		ret = i;
+	else if (ret >= 0)
+		ret = -EFAULT;
+
+out_3:
+	mutex_unlock(fault_lock);
+out_2:
+	if (seg_tg->mm != vma->vm_mm)
+		xpmem_mmap_read_unlock(seg_tg->mm);
+out_1:
+	xpmem_seg_up_read(seg_tg, seg, 1);
+	return ret;
+}
+
+/*
+ * XPMEM_ATTACH_POPULATE and XPMEM_CMD_PREFETCH support. The attachment is
+ * populated one PMD range at a time, the same granularity faults lock at, so
+ * populating never holds off faults on the rest of the attachment for long.
+ */
+struct xpmem_populate_work {
+	struct work_struct work;
+	struct xpmem_attachment *att;
+	u64 start;
+	u64 end;
+	int nid;		/* node of the thread that asked for it */
+};
+
+/*
+ * Pin and map [vaddr, end), which must lie within a single PMD range of the
+ * attachment. Pages missing from the source are skipped and left to be
+ * faulted in later. XPMEM_ATTACH_REPLICATE attachments are populated from
+ * copies on node nid. The caller keeps the seg read-locked.
+ */
+static void
+xpmem_populate_pmd_range(struct xpmem_attachment *att, u64 vaddr, u64 end,
+			 int nid)
+{
+	struct xpmem_segment *seg = att->ap->seg;
+	struct mm_struct *mm = att->mm, *seg_mm = seg->tg->mm;
+	unsigned long pfns[XPMEM_FAULT_AROUND_MAX];
+	struct vm_area_struct *vma;
+	struct mutex *fault_lock;
+	u64 seg_vaddr;
+	int n_pfns, write = !(att->attach_flags & XPMEM_ATTACH_RDONLY);
+	unsigned int inval_seq;
+
+	if (mm != seg_mm && !(seg->make_flags & XPMEM_MAKE_PIN))
+		xpmem_att_place_pages(att, (att->vaddr & PAGE_MASK) +
+				      (vaddr - att->at_vaddr),
+				      (end - vaddr) >> PAGE_SHIFT, write);
+
+	/* same lock ordering as xpmem_fault() */
+	if (mm == seg_mm) {
+		xpmem_mmap_read_lock(mm);
+	} else if (mm < seg_mm) {
+		xpmem_mmap_read_lock(mm);
+		xpmem_mmap_read_lock(seg_mm);
+	} else {
+		xpmem_mmap_read_lock(seg_mm);
+		xpmem_mmap_read_lock(mm);
+	}
+
+	/* the attachment may have been unmapped since xpmem_attach() */
+	vma = find_vma(mm, vaddr);
+	if (!vma || vma->vm_start > vaddr || !xpmem_is_vm_ops_set(vma) ||
+	    vma->vm_private_data != att)
+		goto out;
+	end = min_t(u64, end, vma->vm_end);
+
+	fault_lock = xpmem_att_fault_lock(att, vaddr, 0);
+	mutex_lock(fault_lock);
+	while (vaddr < end) {
+		if (xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING) ||
+		    (seg->flags & XPMEM_FLAG_DESTROYING))
+			break;
+
+		n_pfns = min_t(u64, XPMEM_FAULT_AROUND_MAX,
+			       (end - vaddr) >> PAGE_SHIFT);
+		seg_vaddr = (att->vaddr & PAGE_MASK) + (vaddr - att->at_vaddr);
+		if (xpmem_att_pins_pages(att))
+			inval_seq = xpmem_att_invalidate_begin(att);
+		if (seg->make_flags & XPMEM_MAKE_PIN)
+			n_pfns = xpmem_map_prepinned(vma, seg, vaddr, seg_vaddr,
+					n_pfns, xpmem_att_replica_nid(att, nid));
+		else if (att->attach_flags & XPMEM_ATTACH_NOPIN)
+			n_pfns = xpmem_map_nopin(att, vma, vaddr, seg_vaddr,
+						 n_pfns, write);
+		else
+			n_pfns = xpmem_ensure_valid_PFNs(seg, seg_vaddr, n_pfns,
+							 pfns, write);
+		if (n_pfns <= 0) {
+			vaddr += PAGE_SIZE;
+			continue;
+		}
+
+		xpmem_att_set_validPTEs(att);
+
+		if (xpmem_att_pins_pages(att)) {
+			xpmem_map_pfns(vma, seg, vaddr, pfns, n_pfns);
+			xpmem_fault_mapped_stale(att, vaddr,
+						 (u64)n_pfns << PAGE_SHIFT,
+						 inval_seq);
+		}
+		vaddr += (u64)n_pfns << PAGE_SHIFT;
+	}
+	mutex_unlock(fault_lock);
+
+out:
+	if (mm != seg_mm)
+		xpmem_mmap_read_unlock(seg_mm);
+	xpmem_mmap_read_unlock(mm);
+}
+
+static void
+xpmem_populate_range(struct xpmem_attachment *att, u64 start, u64 end,
+		     int nid)
+{
+	u64 next;
+
+	for (; start < end; start = next) {
+		next = min_t(u64, end, (start & PMD_MASK) + PMD_SIZE);
+		xpmem_populate_pmd_range(att, start, next, nid);
+		cond_resched();
+	}
+}
+
+static void
+xpmem_populate_worker(struct work_struct *work)
+{
+	struct xpmem_populate_work *pw;
+
+	pw = container_of(work, struct xpmem_populate_work, work);
+	xpmem_populate_range(pw->att, pw->start, pw->end, pw->nid);
+}
+
+/*
+ * Populate a newly created attachment. Attachments spanning more than one
+ * XPMEM_POPULATE_CHUNK are split into PMD aligned pieces, one per worker,
+ * that run on xpmem_wq near the source's memory while the attaching thread
+ * populates the first piece itself. Population is best effort like
+ * MAP_POPULATE: anything that cannot be mapped now is faulted in later.
+ */
+static void
+xpmem_populate(struct xpmem_attachment *att)
+{
+	struct xpmem_populate_work *works = NULL;
+	u64 start = att->at_vaddr, end = att->at_vaddr + att->at_size;
+	u64 chunk, next;
+	int i, node, nr_works;
+
+	nr_works = min_t(u64, num_online_cpus(),
+			 DIV_ROUND_UP(att->at_size, XPMEM_POPULATE_CHUNK));
+	nr_works = min(nr_works, XPMEM_POPULATE_MAX_WORKERS);
+	if (nr_works > 1)
+		works = kcalloc(nr_works, sizeof(*works), GFP_KERNEL);
+	if (works == NULL) {
+		xpmem_populate_range(att, start, end, numa_node_id());
+		return;
+	}
+
+	chunk = ALIGN(DIV_ROUND_UP(att->at_size, nr_works), PMD_SIZE);
+	node = cpu_to_node(task_cpu(att->ap->seg->tg->group_leader));
+
+	for (i = 0; i < nr_works && start < end; i++, start = next) {
+		next = (i == nr_works - 1) ? end :
+			min_t(u64, end, (start + chunk) & PMD_MASK);
+		works[i].att = att;
+		works[i].start = start;
+		works[i].end = next;
+		works[i].nid = numa_node_id();
+		INIT_WORK(&works[i].work, xpmem_populate_worker);
+		if (i == 0)
+			continue;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+		queue_work_node(node, xpmem_wq, &works[i].work);
+#else
+		queue_work(xpmem_wq, &works[i].work);
+#endif
+	}
+	nr_works = i;
 
-	att->flags |= XPMEM_FLAG_VALIDPTEs;
+	xpmem_populate_range(att, works[0].start, works[0].end, works[0].nid);
+	for (i = 1; i < nr_works; i++)
+		flush_work(&works[i].work);
 
-out_2:
-	xpmem_seg_up_read(seg_tg, seg, 1);
-out_1:
-	xpmem_ap_deref(ap);
-	xpmem_tg_deref(ap_tg);
+	kfree(works);
+}
 
-	ret = VM_FAULT_SIGBUS;
+static void
+xpmem_prefetch_worker(struct work_struct *work)
+{
+	struct xpmem_populate_work *pw;
+	struct xpmem_attachment *att;
+	struct xpmem_access_permit *ap;
+	struct xpmem_segment *seg;
+	struct xpmem_thread_group *seg_tg;
+	struct mm_struct *mm;
 
-	/*
-	 * remap_pfn_range() does not allow racing threads to each insert
-	 * the PFN for a given virtual address.  To account for this, we
-	 * call remap_pfn_range() with the att->mutex locked and don't
-	 * perform the redundant remap_pfn_range() when a PFN already exists.
-	 */
-        if (pfn && pfn_valid(pfn)) {
-		old_pfn = xpmem_vaddr_to_PFN(current->mm, vaddr);
-		if (old_pfn) {
-			if (old_pfn == pfn) {
-				ret = VM_FAULT_NOPAGE;
-			} else {
-				/* should not be possible, but just in case */
-				printk("xpmem_fault_handler: pfn mismatch: "
-				       "%ld != %ld\n", old_pfn, pfn);
-			}
+	pw = container_of(work, struct xpmem_populate_work, work);
+	att = pw->att;
+	ap = att->ap;
+	seg = ap->seg;
+	seg_tg = seg->tg;
+	mm = att->mm;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
-			put_page(pfn_to_page(pfn));
-#else
-			page_cache_release(pfn_to_page(pfn));
-#endif
-			atomic_dec(&seg->tg->n_pinned);
-			atomic_inc(&xpmem_my_part->n_unpinned);
-			goto out;
-		}
+	/* prefetches of att queued from now on need another worker */
+	mutex_lock(&att->mutex);
+	att->prefetch = NULL;
+	mutex_unlock(&att->mutex);
 
-		XPMEM_DEBUG("calling remap_pfn_range() vaddr=%llx, pfn=%lx",
-				vaddr, pfn);
-		if ((remap_pfn_range(vma, vaddr, pfn, PAGE_SIZE,
-				     vma->vm_page_prot)) == 0) {
-			ret = VM_FAULT_NOPAGE;
+	/* the consumer may have exited since the prefetch was queued */
+	if (mmget_not_zero(mm)) {
+		if (xpmem_seg_down_read(seg_tg, seg, 1, 1) == 0) {
+			xpmem_populate_range(att, pw->start, pw->end, pw->nid);
+			xpmem_seg_up_read(seg_tg, seg, 1);
 		}
+		mmput(mm);
 	}
-out:
-	if (seg_tg_mmap_sem_locked)
-		xpmem_mmap_read_unlock(seg_tg->mm);
-
-	if (att_locked)
-		mutex_unlock(&att->mutex);
+	mmdrop(mm);
 
-	/* NTH: Cray had this conditional on att_locked but that seems incorrect.
-         * Looks like I was correct. Cray fixed this as well. */
-        xpmem_tg_deref(seg_tg);
-        xpmem_seg_deref(seg);
+	xpmem_tg_deref(seg_tg);
+	xpmem_seg_deref(seg);
+	xpmem_ap_deref(ap);
 	xpmem_att_deref(att);
-
-	if (ret == VM_FAULT_SIGBUS) {
-		XPMEM_DEBUG("fault returning SIGBUS vaddr=%llx, pfn=%lx", vaddr, pfn);
-	}
-
-	return ret;
+	kfree(pw);
 }
 
-struct vm_operations_struct xpmem_vm_ops = {
-	.open = xpmem_open_handler,
-	.close = xpmem_close_handler,
-	.fault = xpmem_fault_handler
-};
-
 /*
- * This function is called via the Linux kernel mmap() code, which is
- * instigated by the call to do_mmap() in xpmem_attach().
+ * Queue background population of [vaddr, vaddr + size), which must lie
+ * within a single attachment of the current thread group, and return
+ * without waiting for it. Each attachment has at most one prefetch queued;
+ * further ones that come in before it has started widen its range instead.
  */
 int
-xpmem_mmap(struct file *file, struct vm_area_struct *vma)
+xpmem_prefetch(u64 vaddr, size_t size)
 {
-	/*
-	 * When a mapping is related to a file, the file pointer is typically
-	 * stored in vma->vm_file and a fput() is done to it when the VMA is
-	 * unmapped. Since file is of no interest in XPMEM's case, we ensure
-	 * vm_file is empty and do the fput() here.
-	 */
-	vma->vm_file = NULL;
-	fput(file);
+	struct xpmem_populate_work *pw;
+	struct xpmem_attachment *att;
+	struct xpmem_access_permit *ap;
+	struct vm_area_struct *vma;
+	u64 end;
+	int ret = 0;
 
-	vma->vm_ops = &xpmem_vm_ops;
-	return 0;
+	if (size == 0)
+		return 0;
+
+	end = PAGE_ALIGN(vaddr + size);
+	vaddr &= PAGE_MASK;
+	if (end <= vaddr)
+		return -EINVAL;
+
+	xpmem_mmap_read_lock(current->mm);
+
+	vma = find_vma(current->mm, vaddr);
+	if (!vma || vma->vm_start > vaddr || end > vma->vm_end ||
+	    !xpmem_is_vm_ops_set(vma) || vma->vm_private_data == NULL) {
+		ret = -EINVAL;
+		goto out;
+	}
+	att = (struct xpmem_attachment *)vma->vm_private_data;
+	ap = att->ap;
+
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING) ||
+	    (ap->flags & XPMEM_FLAG_DESTROYING)) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	mutex_lock(&att->mutex);
+	pw = att->prefetch;
+	if (pw != NULL) {
+		pw->start = min(pw->start, vaddr);
+		pw->end = max(pw->end, end);
+		goto out_unlock;
+	}
+
+	pw = kmalloc(sizeof(struct xpmem_populate_work), GFP_KERNEL);
+	if (pw == NULL) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+
+	/* the worker drops these references */
+	xpmem_att_ref(att);
+	xpmem_ap_ref(ap);
+	xpmem_seg_ref(ap->seg);
+	xpmem_tg_ref(ap->seg->tg);
+	mmgrab(att->mm);
+
+	pw->att = att;
+	pw->start = vaddr;
+	pw->end = end;
+	pw->nid = numa_node_id();
+	INIT_WORK(&pw->work, xpmem_prefetch_worker);
+	att->prefetch = pw;
+	queue_work(xpmem_wq, &pw->work);
+
+out_unlock:
+	mutex_unlock(&att->mutex);
+out:
+	xpmem_mmap_read_unlock(current->mm);
+	return ret;
 }
 
 /*
@@ -393,18 +1949,32 @@ int
 xpmem_attach(struct file *file, xpmem_apid_t apid, off_t offset, size_t size,
 	     u64 vaddr, int fd, int att_flags, u64 *at_vaddr_p)
 {
-	int ret;
+	int i, ret, block_recall;
 	unsigned long flags, prot_flags = PROT_READ | PROT_WRITE;
-	u64 seg_vaddr, at_vaddr;
+	u64 seg_vaddr, at_vaddr, mmap_off;
 	struct xpmem_thread_group *ap_tg, *seg_tg;
 	struct xpmem_access_permit *ap;
 	struct xpmem_segment *seg;
 	struct xpmem_attachment *att;
 	struct vm_area_struct *vma;
 
-	if (apid <= 0)
+	if (apid <= 0 || (att_flags & ~XPMEM_ATTACH_VALID_FLAGS) ||
+	    !xpmem_place_valid(att_flags))
 		return -EINVAL;
 
+#ifndef XPMEM_HAVE_HMM
+	if (att_flags & XPMEM_ATTACH_NOPIN)
+		return -EOPNOTSUPP;
+#endif
+#ifndef XPMEM_HAVE_ATTACH_PAGES
+	if (att_flags & XPMEM_ATTACH_PAGES)
+		return -EOPNOTSUPP;
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+	if (att_flags & XPMEM_ATTACH_SAMEVA)
+		return -EOPNOTSUPP;
+#endif
+
 	/* Ensure vaddr is valid */
 	if (vaddr && vaddr + PAGE_SIZE - offset_in_page(vaddr) >= TASK_SIZE)
 		return -EINVAL;
@@ -432,17 +2002,43 @@ xpmem_attach(struct file *file, xpmem_apid_t apid, off_t offset, size_t size,
 	seg_tg = seg->tg;
 	xpmem_tg_ref(seg_tg);
 
-	ret = xpmem_seg_down_read(seg_tg, seg, 0, 1);
+	/* populating pins pages, which must not race with a recall */
+	block_recall = !!(att_flags & XPMEM_ATTACH_POPULATE);
+	ret = xpmem_seg_down_read(seg_tg, seg, block_recall, 1);
 	if (ret != 0)
 		goto out_1;
 
-	ret = xpmem_validate_access(ap, offset, size, XPMEM_RDWR, &seg_vaddr);
+	/* read-only permits can only be attached read-only */
+	if (ap->mode == XPMEM_RDONLY)
+		att_flags |= XPMEM_ATTACH_RDONLY;
+	if (att_flags & XPMEM_ATTACH_RDONLY)
+		prot_flags = PROT_READ;
+
+	/* consumers must not be able to write to their copies */
+	if ((att_flags & XPMEM_ATTACH_REPLICATE) &&
+	    !(att_flags & XPMEM_ATTACH_RDONLY)) {
+		ret = -EINVAL;
+		goto out_2;
+	}
+
+	ret = xpmem_validate_access(ap, offset, size,
+				    (att_flags & XPMEM_ATTACH_RDONLY) ?
+				    XPMEM_RDONLY : XPMEM_RDWR, &seg_vaddr);
 	if (ret != 0)
 		goto out_2;
 
 	/* size needs to reflect page offset to start of segment */
 	size += offset_in_page(seg_vaddr);
 
+	/* an explicit vaddr must agree with the source's for same-VA attach */
+	if (att_flags & XPMEM_ATTACH_SAMEVA) {
+		if (vaddr != 0 && vaddr != (seg_vaddr & PAGE_MASK)) {
+			ret = -EINVAL;
+			goto out_2;
+		}
+		vaddr = seg_vaddr & PAGE_MASK;
+	}
+
 	/*
 	 * Ensure thread is not attempting to attach its own memory on top
 	 * of itself (i.e. ensure the destination vaddr range doesn't overlap
@@ -464,10 +2060,26 @@ xpmem_attach(struct file *file, xpmem_apid_t apid, off_t offset, size_t size,
 	}
 
 	mutex_init(&att->mutex);
+	for (i = 0; i < XPMEM_ATT_FAULT_LOCKS; i++)
+		mutex_init(&att->fault_mutex[i]);
 	att->vaddr = seg_vaddr;
 	att->at_size = size;
+	att->attach_flags = att_flags;
+	/* a placement policy given at attach time overrides the segment's */
+	att->place = (att_flags & XPMEM_PLACE_MASK) ?
+		     (att_flags & XPMEM_PLACE_FLAGS) :
+		     (seg->make_flags & XPMEM_PLACE_FLAGS);
+	/* placement is best effort, so go without if this fails */
+	if (nr_node_ids > 1 &&
+	    (att->place & XPMEM_PLACE_MASK) != XPMEM_PLACE_CONSUMER &&
+	    !(seg->make_flags & XPMEM_MAKE_PIN))
+		att->placed = kcalloc(BITS_TO_LONGS(xpmem_att_nr_pmds(att)),
+				      sizeof(unsigned long),
+				      GFP_KERNEL | __GFP_NOWARN);
+	att->fault_window = 1;
 	att->ap = ap;
 	INIT_LIST_HEAD(&att->att_list);
+	RB_CLEAR_NODE(&att->att_node);
 	att->mm = current->mm;
 	mutex_init(&att->invalidate_mutex);
 
@@ -486,10 +2098,32 @@ xpmem_attach(struct file *file, xpmem_apid_t apid, off_t offset, size_t size,
 		goto out_3;
 	}
 	spin_unlock(&ap->lock);
+	xpmem_att_link(att);
+
+#ifdef XPMEM_HAVE_HMM
+	/* start tracking the source before anything can be mapped */
+	if (att_flags & XPMEM_ATTACH_NOPIN) {
+		if (!mmget_not_zero(seg_tg->mm)) {
+			ret = -ENOENT;
+			goto out_3;
+		}
+		ret = mmu_interval_notifier_insert(&att->notifier, seg_tg->mm,
+						   seg_vaddr & PAGE_MASK, size,
+						   &xpmem_att_interval_ops);
+		mmput(seg_tg->mm);
+		if (ret != 0)
+			goto out_3;
+	}
+#endif
 
 	flags = MAP_SHARED;
-	if (vaddr != 0)
+	if (vaddr != 0 && !(att_flags & XPMEM_ATTACH_SAMEVA))
 		flags |= MAP_FIXED;
+#ifdef MAP_FIXED_NOREPLACE
+	/* never replace what the consumer has at the source's address */
+	if (att_flags & XPMEM_ATTACH_SAMEVA)
+		flags |= MAP_FIXED_NOREPLACE;
+#endif
 
 	/* check if a segment is already attached in the requested area */
 	if (flags & MAP_FIXED) {
@@ -508,7 +2142,23 @@ xpmem_attach(struct file *file, xpmem_apid_t apid, off_t offset, size_t size,
 		xpmem_mmap_read_unlock(current->mm);
 	}
 
-	at_vaddr = vm_mmap(file, vaddr, size, prot_flags, flags, offset);
+	/*
+	 * The mmap offset is not used by XPMEM other than to tell
+	 * xpmem_get_unmapped_area() where the attachment is in the source,
+	 * and to zap XPMEM_ATTACH_PAGES attachments, which get a range of
+	 * their own.
+	 */
+	mmap_off = seg_vaddr & PAGE_MASK;
+#ifdef XPMEM_HAVE_ATTACH_PAGES
+	if (att_flags & XPMEM_ATTACH_PAGES) {
+		long n_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+		mmap_off = (u64)atomic_long_fetch_add(n_pages,
+						      &xpmem_pages_pgoff) <<
+			   PAGE_SHIFT;
+	}
+#endif
+	at_vaddr = vm_mmap(file, vaddr, size, prot_flags, flags, mmap_off);
 	if (IS_ERR((void *)(uintptr_t) at_vaddr)) {
 		ret = at_vaddr;
 		goto out_3;
@@ -517,14 +2167,26 @@ xpmem_attach(struct file *file, xpmem_apid_t apid, off_t offset, size_t size,
 
 	xpmem_mmap_write_lock(current->mm);
 	vma = find_vma(current->mm, at_vaddr);
-	xpmem_mmap_write_unlock(current->mm);
 
 	vma->vm_private_data = att;
-	vma->vm_flags |=
-	    VM_DONTCOPY | VM_DONTDUMP | VM_IO | VM_DONTEXPAND | VM_PFNMAP;
+	xpmem_vm_flags_set(vma, VM_DONTCOPY | VM_DONTDUMP | VM_DONTEXPAND);
+	/* GUP rejects VM_IO and VM_PFNMAP vmas outright */
+	if (att_flags & XPMEM_ATTACH_PAGES)
+		xpmem_vm_flags_set(vma, VM_MIXEDMAP);
+	else
+		xpmem_vm_flags_set(vma, VM_IO | VM_PFNMAP);
+#ifdef XPMEM_HAVE_HUGE_FAULT
+	/* allow huge_fault even when THP is in "madvise" mode */
+	if (!(att_flags & XPMEM_ATTACH_PAGES))
+		xpmem_vm_flags_set(vma, VM_HUGEPAGE);
+#endif
+	/* keep mprotect() from making a read-only attachment writable */
+	if (att_flags & XPMEM_ATTACH_RDONLY)
+		xpmem_vm_flags_clear(vma, VM_MAYWRITE);
 	vma->vm_ops = &xpmem_vm_ops;
 
 	att->at_vma = vma;
+	xpmem_mmap_write_unlock(current->mm);
 
 	/*
 	 * The attach point where we mapped the portion of the segment the
@@ -538,16 +2200,23 @@ xpmem_attach(struct file *file, xpmem_apid_t apid, off_t offset, size_t size,
 	ret = 0;
 out_3:
 	if (ret != 0) {
-		att->flags |= XPMEM_FLAG_DESTROYING;
-		spin_lock(&ap->lock);
-		list_del_init(&att->att_list);
-		spin_unlock(&ap->lock);
+		xpmem_att_set_flag(att, XPMEM_FLAG_DESTROYING);
+		xpmem_att_unlink(att);
+		xpmem_att_nopin_remove(att);
 		xpmem_att_destroyable(att);
 	}
 	mutex_unlock(&att->mutex);
+
+	/*
+	 * Populate without att->mutex held: the workers need the mmap_lock,
+	 * which xpmem_close_handler() holds while it waits for att->mutex.
+	 */
+	if (ret == 0 && (att_flags & XPMEM_ATTACH_POPULATE))
+		xpmem_populate(att);
+
 	xpmem_att_deref(att);
 out_2:
-	xpmem_seg_up_read(seg_tg, seg, 0);
+	xpmem_seg_up_read(seg_tg, seg, block_recall);
 out_1:
 	xpmem_ap_deref(ap);
 	xpmem_tg_deref(ap_tg);
@@ -593,14 +2262,14 @@ xpmem_detach(u64 at_vaddr)
 	/* ensure we aren't racing with MMU notifier PTE cleanup */
 	mutex_lock(&att->invalidate_mutex);
 
-	if (att->flags & XPMEM_FLAG_DESTROYING) {
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING)) {
 		mutex_unlock(&att->invalidate_mutex);
 		mutex_unlock(&att->mutex);
 		xpmem_att_deref(att);
 		xpmem_mmap_write_unlock(current->mm);
 		return 0;
 	}
-	att->flags |= XPMEM_FLAG_DESTROYING;
+	xpmem_att_set_flag(att, XPMEM_FLAG_DESTROYING);
 
 	mutex_unlock(&att->invalidate_mutex);
 
@@ -608,7 +2277,7 @@ xpmem_detach(u64 at_vaddr)
 	xpmem_ap_ref(ap);
 
 	if (current->tgid != ap->tg->tgid) {
-		att->flags &= ~XPMEM_FLAG_DESTROYING;
+		xpmem_att_clear_flag(att, XPMEM_FLAG_DESTROYING);
 		xpmem_ap_deref(ap);
 		mutex_unlock(&att->mutex);
 		xpmem_att_deref(att);
@@ -616,15 +2285,14 @@ xpmem_detach(u64 at_vaddr)
 		return -EACCES;
 	}
 
-	xpmem_unpin_pages(ap->seg, current->mm, att->at_vaddr, att->at_size);
+	xpmem_att_fault_barrier(att);
+	xpmem_att_unmap_pages(att, vma);
 
 	vma->vm_private_data = NULL;
 
-	att->flags &= ~XPMEM_FLAG_VALIDPTEs;
+	xpmem_att_clear_validPTEs(att);
 
-	spin_lock(&ap->lock);
-	list_del_init(&att->att_list);
-	spin_unlock(&ap->lock);
+	xpmem_att_unlink(att);
 
 	mutex_unlock(&att->mutex);
 
@@ -673,13 +2341,13 @@ xpmem_detach_att(struct xpmem_access_permit *ap, struct xpmem_attachment *att)
 	/* ensure we aren't racing with MMU notifier PTE cleanup */
 	mutex_lock(&att->invalidate_mutex);
 
-	if (att->flags & XPMEM_FLAG_DESTROYING) {
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING)) {
 		mutex_unlock(&att->invalidate_mutex);
 		mutex_unlock(&att->mutex);
 		xpmem_mmap_write_unlock(mm);
 		return;
 	}
-	att->flags |= XPMEM_FLAG_DESTROYING;
+	xpmem_att_set_flag(att, XPMEM_FLAG_DESTROYING);
 
 	mutex_unlock(&att->invalidate_mutex);
 
@@ -695,15 +2363,14 @@ xpmem_detach_att(struct xpmem_access_permit *ap, struct xpmem_attachment *att)
 	DBUG_ON((vma->vm_end - vma->vm_start) != att->at_size);
 	DBUG_ON(vma->vm_private_data != att);
 
-	xpmem_unpin_pages(ap->seg, mm, att->at_vaddr, att->at_size);
+	xpmem_att_fault_barrier(att);
+	xpmem_att_unmap_pages(att, vma);
 
 	vma->vm_private_data = NULL;
 
-	att->flags &= ~XPMEM_FLAG_VALIDPTEs;
+	xpmem_att_clear_validPTEs(att);
 
-	spin_lock(&ap->lock);
-	list_del_init(&att->att_list);
-	spin_unlock(&ap->lock);
+	xpmem_att_unlink(att);
 
 	/* NTH: drop the semaphore and attachment lock before calling vm_munmap */
 	mutex_unlock(&att->mutex);
@@ -721,48 +2388,25 @@ xpmem_detach_att(struct xpmem_access_permit *ap, struct xpmem_attachment *att)
 }
 
 /*
- * Clear all of the PTEs associated with the specified attachment within the
- * range specified by start and end. The last argument needs to be 0 except
- * when called by the mmu notifier.
+ * Clear the PTEs of att within the source range [start, end). The caller
+ * holds att->invalidate_mutex if from_mmu is set, or att->mm's
+ * mmap_sem/mmap_lock and att->mutex otherwise. Returns the length of the
+ * part of the attachment that was cleared and sets *unpin_at_p to its start.
  */
-static void
-xpmem_clear_PTEs_of_att(struct xpmem_attachment *att, u64 start, u64 end,
-							int from_mmu)
+static u64
+xpmem_clear_PTEs_of_att_locked(struct xpmem_attachment *att, u64 start,
+			       u64 end, int from_mmu, u64 *unpin_at_p)
 {
-	/*
-	 * This function should ideally acquire both att->mm->mmap_sem/mmap_lock
-	 * and att->mutex.  However, if it is called from a MMU notifier
-	 * function, we can not sleep (something both down_read() and
-	 * mutex_lock() can do).  For MMU notifier callouts, we try to
-	 * acquire the locks once anyway, but if one or both locks were
-	 * not acquired, we are technically OK for this function since other
-	 * XPMEM functions assure that the vma structure will not be freed
-	 * from underneath us, and the prior call to xpmem_att_ref() before
-	 * entering the function unsures that att will be valid.
-	 *
-	 * Must lock mmap_sem/mmap_lock before att's sema to prevent deadlock.
-	 */
-
-	if (from_mmu) {
-		mutex_lock(&att->invalidate_mutex);
-		if (att->flags & XPMEM_FLAG_DESTROYING) {
-			mutex_unlock(&att->invalidate_mutex);
-			return;
-		}
-	} else {
-		/* Must lock mmap_sem/mmap_lock before att's sema to prevent deadlock. */
-		xpmem_mmap_read_lock(att->mm);
-		mutex_lock(&att->mutex);
-	}
+	u64 unpin_at, invalidate_len;
 
 	/*
 	 * The att may have been detached before the down() succeeded.
 	 * If not, clear kernel PTEs, flush TLBs, etc.
 	 */
-	if (att->flags & XPMEM_FLAG_VALIDPTEs) {
+	if (xpmem_att_test_flag(att, XPMEM_FLAG_VALIDPTEs)) {
 		struct vm_area_struct *vma;
-		u64 invalidate_start, invalidate_end, invalidate_len;
-		u64 offset_start, offset_end, unpin_at;
+		u64 invalidate_start, invalidate_end;
+		u64 offset_start, offset_end;
 		u64 att_vaddr_end = att->vaddr + att->at_size;
 
 		/* 
@@ -789,7 +2433,7 @@ xpmem_clear_PTEs_of_att(struct xpmem_attachment *att, u64 start, u64 end,
 		invalidate_start = max(start, att->vaddr);
 		invalidate_end = min(end, att_vaddr_end);
 		if (invalidate_start >= att_vaddr_end || invalidate_end <= att->vaddr)
-			goto out;
+			return 0;
 
 		/* Convert the intersection of vaddr into offsets. */
 		offset_start = invalidate_start - att->vaddr;
@@ -807,8 +2451,9 @@ xpmem_clear_PTEs_of_att(struct xpmem_attachment *att, u64 start, u64 end,
 				unpin_at, invalidate_len);
 
 		/* Unpin the pages */
-		xpmem_unpin_pages(att->ap->seg, att->mm, unpin_at,
-							invalidate_len);
+		if (xpmem_att_pins_pages(att))
+			xpmem_unpin_pages(att->ap->seg, att->mm, unpin_at,
+					  invalidate_len);
 
 		/*
 		 * Clear the PTEs, using the vma out of the att if we
@@ -821,71 +2466,364 @@ xpmem_clear_PTEs_of_att(struct xpmem_attachment *att, u64 start, u64 end,
 
 		/* NTH: is this a viable alternative to zap_page_range(). The
 		 * benefit of zap_vma_ptes is that it is exported by default. */
-		(void) zap_vma_ptes (vma, unpin_at, invalidate_len);
+		xpmem_zap_ptes(vma, unpin_at, invalidate_len);
 
 		/* Only clear the flag if all pages were zapped */
 		if (offset_start == 0 && att->at_size == invalidate_len)
-			att->flags &= ~XPMEM_FLAG_VALIDPTEs;
-	}
-out:
-	if (from_mmu) {
-		mutex_unlock(&att->invalidate_mutex);
-	} else {
-		mutex_unlock(&att->mutex);
-		xpmem_mmap_read_unlock(att->mm);
+			xpmem_att_clear_validPTEs(att);
+
+		*unpin_at_p = unpin_at;
+		return invalidate_len;
 	}
+	return 0;
 }
 
+#define XPMEM_CLEAR_BATCH	16	/* atts cleared per seg->lock hold */
+#define XPMEM_CLEAR_INFLIGHT	8	/* fanned out batches in flight at once */
+
 /*
- * Clear all of the PTEs associated with all attachments related to the
- * specified access permit within the range specified by start and end.
- * The last argument needs to be 0 except when called by the mmu notifier.
+ * Clear the PTEs within the source range [start, end) of the n_atts
+ * attachments in atts, which all belong to the same consumer mm. The PTEs
+ * are cleared back to back, under a single hold of the mm's
+ * mmap_sem/mmap_lock when not called by the mmu notifier. This only batches
+ * the locking: each attachment is a vma of its own, which is zapped and
+ * TLB-flushed separately. The length and start of what was cleared of
+ * atts[i] go to invalidate_len[i] and unpin_at[i].
  */
 static void
-xpmem_clear_PTEs_of_ap(struct xpmem_access_permit *ap, u64 start, u64 end,
-							int from_mmu)
+xpmem_clear_PTEs_of_mm(struct xpmem_attachment **atts, int n_atts, u64 start,
+		       u64 end, int from_mmu, u64 *unpin_at,
+		       u64 *invalidate_len)
 {
+	struct mm_struct *mm = atts[0]->mm;
 	struct xpmem_attachment *att;
+	int i;
 
-	spin_lock(&ap->lock);
-	list_for_each_entry(att, &ap->att_list, att_list) {
-		if (!(att->flags & XPMEM_FLAG_VALIDPTEs))
+	/*
+	 * This function should ideally acquire both att->mm->mmap_sem/mmap_lock
+	 * and att->mutex.  However, if it is called from a MMU notifier
+	 * function, we can not sleep (something both down_read() and
+	 * mutex_lock() can do).  For MMU notifier callouts, we try to
+	 * acquire the locks once anyway, but if one or both locks were
+	 * not acquired, we are technically OK for this function since other
+	 * XPMEM functions assure that the vma structure will not be freed
+	 * from underneath us, and the prior call to xpmem_att_ref() before
+	 * entering the function unsures that att will be valid.
+	 *
+	 * Must lock mmap_sem/mmap_lock before att's sema to prevent deadlock.
+	 */
+	if (!from_mmu)
+		xpmem_mmap_read_lock(mm);
+
+	for (i = 0; i < n_atts; i++) {
+		att = atts[i];
+		invalidate_len[i] = 0;
+
+		/* the interval notifier of pin-free attachments sees these
+		 * already */
+		if (from_mmu && (att->attach_flags & XPMEM_ATTACH_NOPIN))
 			continue;
 
-		xpmem_att_ref(att);  /* don't care if XPMEM_FLAG_DESTROYING */
-		spin_unlock(&ap->lock);
+		if (from_mmu) {
+			mutex_lock(&att->invalidate_mutex);
+			if (!xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING))
+				invalidate_len[i] =
+					xpmem_clear_PTEs_of_att_locked(att,
+						start, end, 1, &unpin_at[i]);
+			mutex_unlock(&att->invalidate_mutex);
+		} else {
+			mutex_lock(&att->mutex);
+			invalidate_len[i] =
+				xpmem_clear_PTEs_of_att_locked(att, start, end,
+							       0, &unpin_at[i]);
+			mutex_unlock(&att->mutex);
+		}
+	}
+
+	if (!from_mmu)
+		xpmem_mmap_read_unlock(mm);
+}
 
-		xpmem_clear_PTEs_of_att(att, start, end, from_mmu);
+struct xpmem_clear_work {
+	struct work_struct work;
+	struct xpmem_attachment **atts;	/* atts of one consumer mm */
+	int n_atts;
+	u64 start;
+	u64 end;
+	int from_mmu;
+	u64 *unpin_at;
+	u64 *invalidate_len;
+};
 
-		spin_lock(&ap->lock);
-		if (list_empty(&att->att_list)) {
-			/* att was deleted from ap->att_list, start over */
-			xpmem_att_deref(att);
-			att = list_entry(&ap->att_list, struct xpmem_attachment,
-					 att_list);
-		} else
-			xpmem_att_deref(att);
+static void
+xpmem_clear_worker(struct work_struct *work)
+{
+	struct xpmem_clear_work *cw;
+
+	cw = container_of(work, struct xpmem_clear_work, work);
+	xpmem_clear_PTEs_of_mm(cw->atts, cw->n_atts, cw->start, cw->end,
+			       cw->from_mmu, cw->unpin_at, cw->invalidate_len);
+}
+
+/*
+ * A batch of attachments taken off seg->att_tree under one hold of seg->lock,
+ * grouped by consumer mm, along with the workers clearing all of its groups
+ * but the first when it is fanned out.
+ */
+struct xpmem_clear_batch {
+	struct list_head list;		/* fanned out batches, oldest first */
+	struct xpmem_attachment *atts[XPMEM_CLEAR_BATCH];
+	u64 unpin_at[XPMEM_CLEAR_BATCH];
+	u64 invalidate_len[XPMEM_CLEAR_BATCH];
+	int group[XPMEM_CLEAR_BATCH + 1];	/* first att of each mm */
+	int n_atts;
+	int n_groups;
+	struct xpmem_clear_work works[];	/* groups 1 to n_groups - 1 */
+};
+
+/*
+ * Move the atts of batch that belong to the same consumer mm next to each
+ * other and record where each mm's atts start.
+ */
+static void
+xpmem_clear_batch_group(struct xpmem_clear_batch *batch)
+{
+	struct xpmem_attachment **atts = batch->atts;
+	struct mm_struct *mm;
+	int i, j, n_groups;
+
+	batch->group[0] = 0;
+	for (n_groups = 0; batch->group[n_groups] < batch->n_atts; n_groups++) {
+		i = batch->group[n_groups];
+		mm = atts[i]->mm;
+		for (i++, j = i; j < batch->n_atts; j++) {
+			if (atts[j]->mm == mm) {
+				swap(atts[i], atts[j]);
+				i++;
+			}
+		}
+		batch->group[n_groups + 1] = i;
+	}
+	batch->n_groups = n_groups;
+}
+
+/*
+ * Clear the PTEs of groups [first, last) of batch from the current thread.
+ */
+static void
+xpmem_clear_batch_groups(struct xpmem_clear_batch *batch, int first, int last,
+			 u64 start, u64 end, int from_mmu)
+{
+	int i, g;
+
+	for (i = first; i < last; i++) {
+		g = batch->group[i];
+		xpmem_clear_PTEs_of_mm(&batch->atts[g], batch->group[i + 1] - g,
+				       start, end, from_mmu, &batch->unpin_at[g],
+				       &batch->invalidate_len[g]);
+	}
+}
+
+/*
+ * Queue a worker on xpmem_wq for each group of batch but the first, which
+ * the current thread clears itself.
+ */
+static void
+xpmem_clear_batch_start(struct xpmem_clear_batch *batch, u64 start, u64 end,
+			int from_mmu)
+{
+	struct xpmem_clear_work *cw;
+	int i, g;
+
+	for (i = 1; i < batch->n_groups; i++) {
+		g = batch->group[i];
+		cw = &batch->works[i - 1];
+		cw->atts = &batch->atts[g];
+		cw->n_atts = batch->group[i + 1] - g;
+		cw->start = start;
+		cw->end = end;
+		cw->from_mmu = from_mmu;
+		cw->unpin_at = &batch->unpin_at[g];
+		cw->invalidate_len = &batch->invalidate_len[g];
+		INIT_WORK(&cw->work, xpmem_clear_worker);
+		queue_work(xpmem_wq, &cw->work);
+	}
+	xpmem_clear_batch_groups(batch, 0, 1, start, end, from_mmu);
+}
+
+/*
+ * Wait for the workers of a fanned out batch, if any, and pass what was
+ * cleared of each att on to its reexports.
+ */
+static void
+xpmem_clear_batch_finish(struct xpmem_clear_batch *batch, int fanned_out)
+{
+	int i;
+
+	for (i = 1; fanned_out && i < batch->n_groups; i++)
+		flush_work(&batch->works[i - 1].work);
+
+	for (i = 0; i < batch->n_atts; i++) {
+		if (batch->invalidate_len[i])
+			xpmem_att_invalidate_reexports(batch->atts[i],
+						       batch->unpin_at[i],
+						       batch->invalidate_len[i]);
+	}
+}
+
+/*
+ * Drop the references xpmem_clear_PTEs_range() took on the atts of batch.
+ */
+static void
+xpmem_clear_batch_put(struct xpmem_clear_batch *batch)
+{
+	struct xpmem_access_permit *ap;
+	int i;
+
+	for (i = 0; i < batch->n_atts; i++) {
+		ap = batch->atts[i]->ap;
+		xpmem_att_deref(batch->atts[i]);
+		xpmem_ap_deref(ap);
 	}
-	spin_unlock(&ap->lock);
 }
 
 /*
  * Clear all of the PTEs associated with all attaches to the specified segment
  * within the range specified by start and end. The last argument needs to be
  * 0 except when called by the mmu notifier.
+ *
+ * The atts are taken off seg->att_tree XPMEM_CLEAR_BATCH at a time and are
+ * cleared one consumer mm after the other. Once the atts seen so far belong
+ * to at least invalidate_fanout consumers, each consumer of a batch but the
+ * first is cleared by a worker on xpmem_wq instead, while this thread clears
+ * the first and moves on to the next batch. Up to XPMEM_CLEAR_INFLIGHT
+ * batches are in flight before the oldest is waited for, so the time taken
+ * approaches that of the slowest consumer rather than the sum of all of them.
+ * Reclaim does not fan out, as it can't wait for workers that may need memory
+ * to start.
  */
 void
 xpmem_clear_PTEs_range(struct xpmem_segment *seg, u64 start, u64 end,
 								int from_mmu)
+{
+	struct xpmem_clear_batch stack_batch, *batch, *fanned_out;
+	struct xpmem_attachment *att, *last;
+	LIST_HEAD(inflight);
+	int n_inflight = 0, n_consumers = 0;
+
+	if (start >= end)
+		return;
+
+	batch = &stack_batch;
+	spin_lock(&seg->lock);
+	att = xpmem_att_tree_iter_first(&seg->att_tree, start, end - 1);
+	while (att != NULL) {
+		for (batch->n_atts = 0;
+		     att != NULL && batch->n_atts < XPMEM_CLEAR_BATCH;
+		     att = xpmem_att_tree_iter_next(att, start, end - 1)) {
+			if (!xpmem_att_test_flag(att, XPMEM_FLAG_VALIDPTEs))
+				continue;
+
+			/* don't care if XPMEM_FLAG_DESTROYING */
+			xpmem_ap_ref(att->ap);
+			xpmem_att_ref(att);
+			batch->atts[batch->n_atts++] = att;
+		}
+		if (batch->n_atts == 0)
+			break;
+		last = batch->atts[batch->n_atts - 1];
+		spin_unlock(&seg->lock);
+
+		xpmem_clear_batch_group(batch);
+		n_consumers += batch->n_groups;
+		fanned_out = NULL;
+		if (batch->n_groups > 1 && xpmem_invalidate_fanout != 0 &&
+		    n_consumers >= xpmem_invalidate_fanout &&
+		    !(current->flags & PF_MEMALLOC))
+			fanned_out = kmalloc(struct_size(fanned_out, works,
+							 batch->n_groups - 1),
+					     GFP_NOWAIT);
+
+		if (fanned_out != NULL) {
+			memcpy(fanned_out, batch, sizeof(*batch));
+			if (n_inflight == XPMEM_CLEAR_INFLIGHT) {
+				batch = list_first_entry(&inflight,
+						struct xpmem_clear_batch, list);
+				list_del(&batch->list);
+				xpmem_clear_batch_finish(batch, 1);
+				xpmem_clear_batch_put(batch);
+				kfree(batch);
+				n_inflight--;
+			}
+			xpmem_clear_batch_start(fanned_out, start, end,
+						from_mmu);
+			list_add_tail(&fanned_out->list, &inflight);
+			n_inflight++;
+			batch = &stack_batch;
+		} else {
+			xpmem_clear_batch_groups(batch, 0, batch->n_groups,
+						 start, end, from_mmu);
+			xpmem_clear_batch_finish(batch, 0);
+		}
+
+		spin_lock(&seg->lock);
+		if (RB_EMPTY_NODE(&last->att_node)) {
+			/* last was removed from seg->att_tree, start over */
+			att = xpmem_att_tree_iter_first(&seg->att_tree,
+							start, end - 1);
+		} else
+			att = xpmem_att_tree_iter_next(last, start, end - 1);
+
+		/* the refs of fanned out atts are dropped once they are done */
+		if (fanned_out == NULL)
+			xpmem_clear_batch_put(batch);
+	}
+	spin_unlock(&seg->lock);
+
+	while (!list_empty(&inflight)) {
+		batch = list_first_entry(&inflight, struct xpmem_clear_batch,
+					 list);
+		list_del(&batch->list);
+		xpmem_clear_batch_finish(batch, 1);
+		xpmem_clear_batch_put(batch);
+		kfree(batch);
+	}
+}
+
+/*
+ * Wait for faults on any attachment of seg that have checked for
+ * XPMEM_FLAG_DESTROYING to finish mapping. Used for sealed segments, whose
+ * faults don't hold seg->sema.
+ */
+void
+xpmem_seg_fault_barrier(struct xpmem_segment *seg)
 {
 	struct xpmem_access_permit *ap;
+	struct xpmem_attachment *att;
 
 	spin_lock(&seg->lock);
 	list_for_each_entry(ap, &seg->ap_list, ap_list) {
-		xpmem_ap_ref(ap);  /* don't care if XPMEM_FLAG_DESTROYING */
+		xpmem_ap_ref(ap);
 		spin_unlock(&seg->lock);
 
-		xpmem_clear_PTEs_of_ap(ap, start, end, from_mmu);
+		spin_lock(&ap->lock);
+		list_for_each_entry(att, &ap->att_list, att_list) {
+			xpmem_att_ref(att);
+			spin_unlock(&ap->lock);
+
+			xpmem_att_fault_barrier(att);
+
+			spin_lock(&ap->lock);
+			if (list_empty(&att->att_list)) {
+				/* att was deleted from ap->att_list, start over */
+				xpmem_att_deref(att);
+				att = list_entry(&ap->att_list,
+						 struct xpmem_attachment,
+						 att_list);
+			} else
+				xpmem_att_deref(att);
+		}
+		spin_unlock(&ap->lock);
 
 		spin_lock(&seg->lock);
 		if (list_empty(&ap->ap_list)) {
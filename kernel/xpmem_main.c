@@ -29,6 +29,7 @@
 #include <linux/mm.h>
 #include <linux/file.h>
 #include <linux/proc_fs.h>
+#include <linux/workqueue.h>
 #include "xpmem_internal.h"
 #include "xpmem_private.h"
 
@@ -47,6 +48,33 @@
 #endif
 
 struct xpmem_partition *xpmem_my_part = NULL;  /* pointer to this partition */
+struct workqueue_struct *xpmem_wq = NULL;	/* populate, prefetch and
+						 * invalidation fan-out */
+
+unsigned int xpmem_fault_around_pages = XPMEM_FAULT_AROUND_DEFAULT;
+module_param_named(fault_around_pages, xpmem_fault_around_pages, uint, 0644);
+MODULE_PARM_DESC(fault_around_pages,
+		 "Maximum number of pages mapped per attachment fault (1 disables)");
+
+unsigned int xpmem_migrate_interval_ms = 10;
+module_param_named(migrate_interval_ms, xpmem_migrate_interval_ms, uint, 0644);
+MODULE_PARM_DESC(migrate_interval_ms,
+		 "Minimum time between migrations of XPMEM_MAKE_MIGRATE segment ranges");
+
+unsigned int xpmem_attach_wait_ms = 10000;
+module_param_named(attach_wait_ms, xpmem_attach_wait_ms, uint, 0644);
+MODULE_PARM_DESC(attach_wait_ms,
+		 "Time XPMEM_ATTACH_WAIT faults wait for the source to map memory");
+
+unsigned int xpmem_invalidate_fanout = 8;
+module_param_named(invalidate_fanout, xpmem_invalidate_fanout, uint, 0644);
+MODULE_PARM_DESC(invalidate_fanout,
+		 "Consumers of an invalidation from which their PTEs are cleared in parallel (0 disables)");
+
+unsigned int xpmem_replica_max_pages = 262144;
+module_param_named(replica_max_pages, xpmem_replica_max_pages, uint, 0644);
+MODULE_PARM_DESC(replica_max_pages,
+		 "Maximum number of pages holding XPMEM_ATTACH_REPLICATE copies (0 disables)");
 static void xpmem_destroy_tg(struct xpmem_thread_group *tg);
 
 /*
@@ -77,6 +105,11 @@ xpmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 	}
 
+	if (xpmem_rwsem_init(&tg->recall_PFNs_sema) != 0) {
+		kfree(tg);
+		return -ENOMEM;
+	}
+
 	spin_lock_init(&tg->lock);
 	tg->tgid = current->tgid;
 	tg->uid = current_uid();
@@ -84,14 +117,13 @@ xpmem_open(struct inode *inode, struct file *file)
 	atomic_set(&tg->uniq_segid, 0);
 	atomic_set(&tg->uniq_apid, 0);
 	atomic_set(&tg->n_pinned, 0);
+	atomic_set(&tg->n_att_mapped, 0);
 	tg->addr_limit = TASK_SIZE;
 	rwlock_init(&tg->seg_list_lock);
 	INIT_LIST_HEAD(&tg->seg_list);
+	tg->seg_tree = XPMEM_RB_ROOT;
 	INIT_LIST_HEAD(&tg->tg_hashlist);
-	atomic_set(&tg->n_recall_PFNs, 0);
 	mutex_init(&tg->recall_PFNs_mutex);
-	init_waitqueue_head(&tg->block_recall_PFNs_wq);
-	init_waitqueue_head(&tg->allow_recall_PFNs_wq);
 	tg->mmu_initialized = 0;
 	tg->mmu_unregister_called = 0;
 	tg->mm = current->mm;
@@ -103,6 +135,7 @@ xpmem_open(struct inode *inode, struct file *file)
 
 	/* Register MMU notifier callbacks */
 	if (xpmem_mmu_notifier_init(tg) != 0) {
+		xpmem_rwsem_free(&tg->recall_PFNs_sema);
 		kfree(tg);
 		return -EFAULT;
 	}
@@ -288,7 +321,7 @@ xpmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 		ret = xpmem_make(make_info.vaddr, make_info.size,
 				 make_info.permit_type,
-				 (void *)make_info.permit_value, &segid);
+				 (void *)make_info.permit_value, 0, &segid);
 		if (ret != 0)
 			return ret;
 
@@ -299,6 +332,28 @@ xpmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		return 0;
 	}
+	case XPMEM_CMD_MAKE_FLAGS: {
+		struct xpmem_cmd_make_flags make_info;
+		xpmem_segid_t segid;
+
+		if (copy_from_user(&make_info, (void __user *)arg,
+				   sizeof(struct xpmem_cmd_make_flags)))
+			return -EFAULT;
+
+		ret = xpmem_make(make_info.make.vaddr, make_info.make.size,
+				 make_info.make.permit_type,
+				 (void *)make_info.make.permit_value,
+				 make_info.flags, &segid);
+		if (ret != 0)
+			return ret;
+
+		if (put_user(segid, &((struct xpmem_cmd_make_flags __user *)
+				      arg)->make.segid)) {
+			(void)xpmem_remove(segid);
+			return -EFAULT;
+		}
+		return 0;
+	}
 	case XPMEM_CMD_REMOVE: {
 		struct xpmem_cmd_remove remove_info;
 
@@ -308,6 +363,15 @@ xpmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 		return xpmem_remove(remove_info.segid);
 	}
+	case XPMEM_CMD_SEAL: {
+		struct xpmem_cmd_remove seal_info;
+
+		if (copy_from_user(&seal_info, (void __user *)arg,
+				   sizeof(struct xpmem_cmd_remove)))
+			return -EFAULT;
+
+		return xpmem_seal(seal_info.segid);
+	}
 	case XPMEM_CMD_GET: {
 		struct xpmem_cmd_get get_info;
 		xpmem_apid_t apid;
@@ -369,6 +433,15 @@ xpmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 		return xpmem_detach(detach_info.vaddr);
 	}
+	case XPMEM_CMD_PREFETCH: {
+		struct xpmem_cmd_prefetch prefetch_info;
+
+		if (copy_from_user(&prefetch_info, (void __user *)arg,
+				   sizeof(struct xpmem_cmd_prefetch)))
+			return -EFAULT;
+
+		return xpmem_prefetch(prefetch_info.vaddr, prefetch_info.size);
+	}
 	case XPMEM_CMD_FORK_BEGIN: {
 		return xpmem_fork_begin();
 	}
@@ -386,7 +459,10 @@ static struct file_operations xpmem_fops = {
 	.open = xpmem_open,
 	.flush = xpmem_flush,
 	.unlocked_ioctl = xpmem_ioctl,
-	.mmap = xpmem_mmap
+	.mmap = xpmem_mmap,
+#ifdef XPMEM_HAVE_HUGE_FAULT
+	.get_unmapped_area = xpmem_get_unmapped_area,
+#endif
 };
 
 static struct miscdevice xpmem_dev_handle = {
@@ -433,6 +509,7 @@ xpmem_init(void)
 	/* create debugging entries in /proc/xpmem */
 	atomic_set(&xpmem_my_part->n_pinned, 0);
 	atomic_set(&xpmem_my_part->n_unpinned, 0);
+	atomic_set(&xpmem_my_part->n_replicas, 0);
 	global_pages_entry = proc_create_data("global_pages", 0644,
 					      xpmem_unpin_procfs_dir,
 					      &xpmem_unpin_procfs_ops,
@@ -451,10 +528,19 @@ xpmem_init(void)
 		goto out_4;
 	}
 
+	/* workers used to populate and prefetch attachments */
+	xpmem_wq = alloc_workqueue(XPMEM_MODULE_NAME, WQ_UNBOUND, 0);
+	if (xpmem_wq == NULL) {
+		ret = -ENOMEM;
+		goto out_5;
+	}
+
 	printk("XPMEM kernel module v%s loaded\n",
 	       XPMEM_CURRENT_VERSION_STRING);
 	return 0;
 
+out_5:
+	remove_proc_entry("debug_printk", xpmem_unpin_procfs_dir);
 out_4:
 	remove_proc_entry("global_pages", xpmem_unpin_procfs_dir);
 out_3:
@@ -472,13 +558,19 @@ out_1:
 void __exit
 xpmem_exit(void)
 {
-	kfree(xpmem_my_part);
+	/*
+	 * Prefetch, migration, populate and fan-out work can outlive every
+	 * open file and still uses xpmem_my_part, so drain it first.
+	 */
+	destroy_workqueue(xpmem_wq);
 
 	misc_deregister(&xpmem_dev_handle);
 	remove_proc_entry("global_pages", xpmem_unpin_procfs_dir);
 	remove_proc_entry("debug_printk", xpmem_unpin_procfs_dir);
 	remove_proc_entry(XPMEM_MODULE_NAME, NULL);
 
+	kfree(xpmem_my_part);
+
 	printk("XPMEM kernel module v%s unloaded\n",
 	       XPMEM_CURRENT_VERSION_STRING);
 }
@@ -490,6 +582,6 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Silicon Graphics, Inc.");
 MODULE_INFO(supported, "external");
 MODULE_DESCRIPTION("XPMEM support");
-MODULE_VERSION("2.6.5");
+MODULE_VERSION("2.7.0");
 module_init(xpmem_init);
 module_exit(xpmem_exit);
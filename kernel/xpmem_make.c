@@ -15,10 +15,22 @@
  */
 
 #include <linux/err.h>
+#include <linux/interval_tree_generic.h>
 #include <linux/mm.h>
 #include "xpmem_internal.h"
 #include "xpmem_private.h"
 
+/*
+ * Interval tree of a tg's segments, keyed by the source addresses they
+ * cover. It lets the MMU notifier find the segments overlapping an
+ * invalidated range without walking all of them.
+ */
+#define xpmem_seg_start(_seg)	((_seg)->vaddr)
+#define xpmem_seg_last(_seg)	((_seg)->vaddr + (_seg)->size - 1)
+
+INTERVAL_TREE_DEFINE(struct xpmem_segment, seg_node, u64, seg_subtree_last,
+		     xpmem_seg_start, xpmem_seg_last, , xpmem_seg_tree)
+
 /*
  * Create a new and unique segid.
  */
@@ -50,14 +62,17 @@ xpmem_make_segid(struct xpmem_thread_group *seg_tg)
  */
 int
 xpmem_make(u64 vaddr, size_t size, int permit_type, void *permit_value,
-	   xpmem_segid_t *segid_p)
+	   int flags, xpmem_segid_t *segid_p)
 {
 	xpmem_segid_t segid;
 	struct xpmem_thread_group *seg_tg;
 	struct xpmem_segment *seg;
+	int ret;
 
 	if (permit_type != XPMEM_PERMIT_MODE ||
-	    ((u64)(uintptr_t)permit_value & ~00777) || size == 0) {
+	    ((u64)(uintptr_t)permit_value & ~00777) || size == 0 ||
+	    (flags & ~XPMEM_MAKE_VALID_FLAGS) || !xpmem_place_valid(flags) ||
+	    ((flags & XPMEM_MAKE_PIN) && (flags & XPMEM_MAKE_MIGRATE))) {
 		return -EINVAL;
 	}
 
@@ -97,23 +112,46 @@ xpmem_make(u64 vaddr, size_t size, int permit_type, void *permit_value,
 		return -ENOMEM;
 	}
 
+	if (xpmem_rwsem_init(&seg->sema) != 0) {
+		kfree(seg);
+		xpmem_tg_deref(seg_tg);
+		return -ENOMEM;
+	}
+
 	spin_lock_init(&seg->lock);
-	init_rwsem(&seg->sema);
 	seg->segid = segid;
 	seg->vaddr = vaddr;
 	seg->size = size;
 	seg->permit_type = permit_type;
 	seg->permit_value = permit_value;
+	seg->make_flags = flags;
 	init_waitqueue_head(&seg->destroyed_wq);
 	seg->tg = seg_tg;
 	INIT_LIST_HEAD(&seg->ap_list);
+	seg->att_tree = XPMEM_RB_ROOT;
+	atomic_set(&seg->invalidate_seq, 0);
 	INIT_LIST_HEAD(&seg->seg_list);
+	RB_CLEAR_NODE(&seg->seg_node);
+
+	if (flags & XPMEM_MAKE_PIN)
+		ret = xpmem_seg_pin_pages(seg);
+	else if (flags & XPMEM_MAKE_MIGRATE)
+		ret = xpmem_migrate_init(seg);
+	else
+		ret = 0;
+	if (ret != 0) {
+		xpmem_rwsem_free(&seg->sema);
+		kfree(seg);
+		xpmem_tg_deref(seg_tg);
+		return ret;
+	}
 
 	xpmem_seg_not_destroyable(seg);
 
 	/* add seg to its tg's list of segs */
 	write_lock(&seg_tg->seg_list_lock);
 	list_add_tail(&seg->seg_list, &seg_tg->seg_list);
+	xpmem_seg_tree_insert(seg, &seg_tg->seg_tree);
 	write_unlock(&seg_tg->seg_list_lock);
 
 	xpmem_tg_deref(seg_tg);
@@ -146,8 +184,13 @@ xpmem_remove_seg(struct xpmem_thread_group *seg_tg, struct xpmem_segment *seg)
 
 	xpmem_seg_down_write(seg);
 
+	/* faults on sealed segments are not kept out by seg->sema */
+	if (seg->flags & XPMEM_FLAG_SEALED)
+		xpmem_seg_fault_barrier(seg);
+
 	/* unpin pages and clear PTEs for each attachment to this segment */
 	xpmem_clear_PTEs(seg);
+	xpmem_seg_unpin_pages(seg);
 
 	/* indicate that the segment has been destroyed */
 	spin_lock(&seg->lock);
@@ -157,6 +200,8 @@ xpmem_remove_seg(struct xpmem_thread_group *seg_tg, struct xpmem_segment *seg)
 	/* Remove segment structure from its tg's list of segs */
 	write_lock(&seg_tg->seg_list_lock);
 	list_del_init(&seg->seg_list);
+	xpmem_seg_tree_remove(seg, &seg_tg->seg_tree);
+	RB_CLEAR_NODE(&seg->seg_node);
 	write_unlock(&seg_tg->seg_list_lock);
 
 	xpmem_seg_up_write(seg);
@@ -222,3 +267,78 @@ xpmem_remove(xpmem_segid_t segid)
 
 	return 0;
 }
+
+/*
+ * Seal a segment: its source promises not to unmap, remap or write the range
+ * anymore. Faults so far pinned pages one attachment at a time. They are
+ * dropped and the range is pinned once for all consumers instead, as for
+ * XPMEM_MAKE_PIN, which keeps the segment out of invalidation and recall.
+ * Faults on a sealed segment then skip seg->sema and blocking recall of PFNs
+ * and only synchronize with xpmem_remove_seg() through the fault locks.
+ */
+int
+xpmem_seal(xpmem_segid_t segid)
+{
+	struct xpmem_thread_group *seg_tg;
+	struct xpmem_segment *seg;
+	int ret = 0;
+
+	if (segid <= 0)
+		return -EINVAL;
+
+	seg_tg = xpmem_tg_ref_by_segid(segid);
+	if (IS_ERR(seg_tg))
+		return PTR_ERR(seg_tg);
+
+	if (current->tgid != seg_tg->tgid) {
+		xpmem_tg_deref(seg_tg);
+		return -EACCES;
+	}
+
+	seg = xpmem_seg_ref_by_segid(seg_tg, segid);
+	if (IS_ERR(seg)) {
+		xpmem_tg_deref(seg_tg);
+		return PTR_ERR(seg);
+	}
+	DBUG_ON(seg->tg != seg_tg);
+
+	/* pages of migrating segments have to stay movable */
+	if (seg->make_flags & XPMEM_MAKE_MIGRATE) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	xpmem_seg_down_write(seg);
+	if (seg->flags & (XPMEM_FLAG_DESTROYING | XPMEM_FLAG_SEALED)) {
+		ret = (seg->flags & XPMEM_FLAG_DESTROYING) ? -ENOENT : 0;
+		goto out_up;
+	}
+
+	ret = xpmem_seg_alloc_replicas(seg);
+	if (ret != 0)
+		goto out_up;
+
+	if (!(seg->make_flags & XPMEM_MAKE_PIN)) {
+		xpmem_clear_PTEs(seg);
+		ret = xpmem_seg_pin_pages(seg);
+		if (ret != 0) {
+			kfree(seg->replicas);
+			seg->replicas = NULL;
+			goto out_up;
+		}
+		seg->make_flags |= XPMEM_MAKE_PIN;
+	}
+
+	/* lockless faults must see the PFN table before the flag */
+	smp_wmb();
+	spin_lock(&seg->lock);
+	seg->flags |= XPMEM_FLAG_SEALED;
+	spin_unlock(&seg->lock);
+
+out_up:
+	xpmem_seg_up_write(seg);
+out:
+	xpmem_seg_deref(seg);
+	xpmem_tg_deref(seg_tg);
+	return ret;
+}
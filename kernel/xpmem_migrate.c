@@ -0,0 +1,339 @@
+/*
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License.  See the file "COPYING" in the main directory of this archive
+ * for more details.
+ */
+
+/*
+ * Cross Partition Memory (XPMEM) automatic NUMA migration support.
+ *
+ * Segments made with XPMEM_MAKE_MIGRATE sample the node of every consumer
+ * fault that pins source pages. Samples are kept per PMD range of the source
+ * in a small hashed table. Each slot holds a majority vote between the nodes
+ * faulting on its range. Once a node other than the one backing the range
+ * wins XPMEM_MIGRATE_VOTES votes in a row, a worker clears the consumers'
+ * PTEs of that range, which drops XPMEM's pins on it, and migrates the
+ * source pages to the winning node. Consumer faults on the range wait until
+ * the pages have moved and then refault them from there.
+ * At most one range per segment is migrated at a time and a new one is only
+ * started migrate_interval_ms after the last.
+ */
+
+#include <linux/hash.h>
+#include <linux/highmem.h>
+#include <linux/migrate.h>
+#include <linux/mm.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "xpmem_internal.h"
+#include "xpmem_private.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/mm.h>
+#endif
+
+#ifdef XPMEM_HAVE_MIGRATE_VMA
+
+#define XPMEM_MIGRATE_SLOTS	512	/* sampled PMD ranges per segment */
+#define XPMEM_MIGRATE_VOTES	4	/* winning margin that migrates */
+#define XPMEM_MIGRATE_BATCH	64	/* pages per migrate_vma_setup() */
+
+/*
+ * A slot packs the PMD index of the range it samples, the node currently
+ * leading the vote and the margin it leads by, so that it can be updated
+ * with a single cmpxchg.
+ */
+#define XPMEM_SLOT_VOTES_BITS	8
+#define XPMEM_SLOT_NID_BITS	12
+#define XPMEM_SLOT_NID_SHIFT	XPMEM_SLOT_VOTES_BITS
+#define XPMEM_SLOT_INDEX_SHIFT	(XPMEM_SLOT_NID_SHIFT + XPMEM_SLOT_NID_BITS)
+
+#define xpmem_slot(_index, _nid, _votes)				\
+	(((u64)(_index) << XPMEM_SLOT_INDEX_SHIFT) |			\
+	 ((u64)(_nid) << XPMEM_SLOT_NID_SHIFT) | (_votes))
+#define xpmem_slot_index(_slot)	((_slot) >> XPMEM_SLOT_INDEX_SHIFT)
+#define xpmem_slot_nid(_slot)						\
+	(((_slot) >> XPMEM_SLOT_NID_SHIFT) & ((1 << XPMEM_SLOT_NID_BITS) - 1))
+#define xpmem_slot_votes(_slot)						\
+	((_slot) & ((1 << XPMEM_SLOT_VOTES_BITS) - 1))
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+#define XPMEM_MIGRATE_PFN_LOCKED	MIGRATE_PFN_LOCKED
+#else
+#define XPMEM_MIGRATE_PFN_LOCKED	0
+#endif
+
+struct xpmem_migrate {
+	struct work_struct work;
+	struct xpmem_segment *seg;	/* segment being sampled */
+	atomic_t pending;		/* work is queued or running */
+	int migrating;			/* faults on vaddr's range must wait */
+	unsigned long next;		/* jiffies when work may be queued */
+	u64 vaddr;			/* PMD range being migrated */
+	int nid;			/* node it is migrated to */
+	atomic_long_t n_ranges;		/* PMD ranges migrated */
+	atomic_long_t n_migrated;	/* pages migrated */
+	atomic_long_t n_failed;		/* pages that could not be migrated */
+	u64 slots[XPMEM_MIGRATE_SLOTS];	/* votes, see xpmem_slot() */
+};
+
+/*
+ * Migrate the pages of [start, end) within vma that are not on nid yet.
+ */
+static void
+xpmem_migrate_vma(struct xpmem_migrate *migrate, struct vm_area_struct *vma,
+		  u64 start, u64 end, int nid)
+{
+	unsigned long src[XPMEM_MIGRATE_BATCH], dst[XPMEM_MIGRATE_BATCH];
+	struct migrate_vma args = {
+		.vma	= vma,
+		.src	= src,
+		.dst	= dst,
+		.flags	= MIGRATE_VMA_SELECT_SYSTEM,
+	};
+	struct page *spage, *dpage;
+	long i, nr, n_migrated = 0, n_failed = 0;
+
+	for (; start < end; start = args.end) {
+		args.start = start;
+		args.end = min_t(u64, end,
+				 start + (XPMEM_MIGRATE_BATCH << PAGE_SHIFT));
+		nr = (args.end - args.start) >> PAGE_SHIFT;
+		/*
+		 * migrate_vma_setup() only clears src[]; every dst[] slot we
+		 * skip below must read as "don't migrate" for
+		 * migrate_vma_pages() and the counting loop.
+		 */
+		memset(dst, 0, nr * sizeof(dst[0]));
+		if (migrate_vma_setup(&args) != 0) {
+			n_failed += nr;
+			continue;
+		}
+
+		for (i = 0; i < nr; i++) {
+			spage = migrate_pfn_to_page(src[i]);
+			if (!spage || page_to_nid(spage) == nid)
+				continue;
+			if (!(src[i] & MIGRATE_PFN_MIGRATE)) {
+				/* still pinned by someone else */
+				n_failed++;
+				continue;
+			}
+
+			dpage = alloc_pages_node(nid, GFP_HIGHUSER_MOVABLE |
+						 __GFP_THISNODE | __GFP_NOWARN, 0);
+			if (!dpage) {
+				n_failed++;
+				continue;
+			}
+			lock_page(dpage);
+			copy_highpage(dpage, spage);
+			dst[i] = migrate_pfn(page_to_pfn(dpage)) |
+				 XPMEM_MIGRATE_PFN_LOCKED;
+		}
+
+		migrate_vma_pages(&args);
+		for (i = 0; i < nr; i++) {
+			if (!dst[i])
+				continue;
+			if (src[i] & MIGRATE_PFN_MIGRATE)
+				n_migrated++;
+			else
+				n_failed++;
+		}
+		migrate_vma_finalize(&args);
+	}
+
+	atomic_long_add(n_migrated, &migrate->n_migrated);
+	atomic_long_add(n_failed, &migrate->n_failed);
+}
+
+static void
+xpmem_migrate_worker(struct work_struct *work)
+{
+	struct xpmem_migrate *migrate = container_of(work, struct xpmem_migrate,
+						     work);
+	struct xpmem_segment *seg = migrate->seg;
+	struct xpmem_thread_group *seg_tg = seg->tg;
+	struct mm_struct *mm = seg_tg->mm;
+	struct vm_area_struct *vma;
+	u64 start, end, vaddr;
+
+	start = max_t(u64, migrate->vaddr, seg->vaddr);
+	end = min_t(u64, migrate->vaddr + PMD_SIZE, seg->vaddr + seg->size);
+
+	if (xpmem_seg_down_read(seg_tg, seg, 0, 1) != 0)
+		goto out;
+	if (!mmget_not_zero(mm)) {
+		xpmem_seg_up_read(seg_tg, seg, 0);
+		goto out;
+	}
+
+	/*
+	 * Consumers refault the range once it has moved. Faults that pinned
+	 * pages of it before seeing migrating set have the sequence move
+	 * under them and unmap the pages again, so no pin of theirs is left
+	 * for migrate_vma_setup() to trip over.
+	 */
+	WRITE_ONCE(migrate->migrating, 1);
+	atomic_inc(&seg->invalidate_seq);
+	smp_mb();	/* pairs with xpmem_migrate_busy() */
+	xpmem_clear_PTEs_range(seg, start, end, 0);
+
+	xpmem_mmap_read_lock(mm);
+	for (vaddr = start; vaddr < end; vaddr = vma->vm_end) {
+		vma = find_vma(mm, vaddr);
+		if (!vma || vma->vm_start >= end)
+			break;
+		vaddr = max_t(u64, vaddr, vma->vm_start);
+		if (!xpmem_is_vm_ops_set(vma))
+			xpmem_migrate_vma(migrate, vma, vaddr,
+					  min_t(u64, end, vma->vm_end),
+					  migrate->nid);
+	}
+	xpmem_mmap_read_unlock(mm);
+	WRITE_ONCE(migrate->migrating, 0);
+	atomic_long_inc(&migrate->n_ranges);
+
+	/* the last mmput() removes seg, which needs it unlocked */
+	xpmem_seg_up_read(seg_tg, seg, 0);
+	mmput(mm);
+out:
+	migrate->next = jiffies + msecs_to_jiffies(xpmem_migrate_interval_ms);
+	atomic_set(&migrate->pending, 0);
+	xpmem_tg_deref(seg_tg);
+	xpmem_seg_deref(seg);
+}
+
+/*
+ * Set up sampling for a segment made with XPMEM_MAKE_MIGRATE.
+ */
+int
+xpmem_migrate_init(struct xpmem_segment *seg)
+{
+	struct xpmem_migrate *migrate;
+
+	migrate = kzalloc(sizeof(struct xpmem_migrate), GFP_KERNEL);
+	if (migrate == NULL)
+		return -ENOMEM;
+
+	INIT_WORK(&migrate->work, xpmem_migrate_worker);
+	migrate->seg = seg;
+	migrate->next = jiffies;
+	seg->migrate = migrate;
+	return 0;
+}
+
+/*
+ * Record that the current thread faulted on the PMD range of seg_vaddr, which
+ * is backed by pfn, and start migrating the range if another node dominates
+ * it. Called from xpmem_fault() with seg read-locked.
+ */
+void
+xpmem_migrate_sample(struct xpmem_segment *seg, u64 seg_vaddr,
+		     unsigned long pfn)
+{
+	struct xpmem_migrate *migrate = seg->migrate;
+	u64 index = seg_vaddr >> PMD_SHIFT, old, new;
+	u64 *slot = &migrate->slots[hash_64(index, ilog2(XPMEM_MIGRATE_SLOTS))];
+	int nid = numa_node_id(), votes;
+
+	do {
+		old = READ_ONCE(*slot);
+		votes = xpmem_slot_votes(old);
+		if (xpmem_slot_index(old) != index || votes == 0)
+			new = xpmem_slot(index, nid, 1);
+		else if (xpmem_slot_nid(old) == nid)
+			new = xpmem_slot(index, nid, min(votes + 1,
+						XPMEM_MIGRATE_VOTES));
+		else
+			new = xpmem_slot(index, xpmem_slot_nid(old), votes - 1);
+	} while (cmpxchg64(slot, old, new) != old);
+
+	if (xpmem_slot_votes(new) < XPMEM_MIGRATE_VOTES ||
+	    nid == page_to_nid(pfn_to_page(pfn)) ||
+	    time_before(jiffies, READ_ONCE(migrate->next)) ||
+	    atomic_xchg(&migrate->pending, 1))
+		return;
+
+	/* start the vote over once the range has moved */
+	cmpxchg64(slot, new, 0);
+
+	migrate->vaddr = index << PMD_SHIFT;
+	migrate->nid = nid;
+	xpmem_seg_ref(seg);
+	xpmem_tg_ref(seg->tg);
+	queue_work(xpmem_wq, &migrate->work);
+}
+
+/*
+ * Check whether the PMD range of seg_vaddr is being migrated. Called from
+ * xpmem_fault() after pinning pages of it, which it releases again if so.
+ */
+int
+xpmem_migrate_busy(struct xpmem_segment *seg, u64 seg_vaddr)
+{
+	struct xpmem_migrate *migrate = seg->migrate;
+
+	smp_mb();	/* pairs with xpmem_migrate_worker() */
+	return READ_ONCE(migrate->migrating) &&
+	       (seg_vaddr & PMD_MASK) == migrate->vaddr;
+}
+
+/*
+ * Wait for a migration of seg to finish. The caller holds a reference on seg
+ * and no locks.
+ */
+void
+xpmem_migrate_wait(struct xpmem_segment *seg)
+{
+	flush_work(&seg->migrate->work);
+}
+
+/*
+ * Print the migration counters of seg to a /proc/xpmem/<tgid> file.
+ */
+void
+xpmem_migrate_show(struct seq_file *seq, struct xpmem_segment *seg)
+{
+	struct xpmem_migrate *migrate = seg->migrate;
+
+	seq_printf(seq, "segment %llx: PMD ranges migrated: %ld, "
+			"pages migrated: %ld, pages not migrated: %ld\n",
+		   (unsigned long long)seg->segid, atomic_long_read(&migrate->n_ranges),
+		   atomic_long_read(&migrate->n_migrated),
+		   atomic_long_read(&migrate->n_failed));
+}
+
+#else /* !XPMEM_HAVE_MIGRATE_VMA */
+
+int
+xpmem_migrate_init(struct xpmem_segment *seg)
+{
+	return -EOPNOTSUPP;
+}
+
+void
+xpmem_migrate_sample(struct xpmem_segment *seg, u64 seg_vaddr,
+		     unsigned long pfn)
+{
+}
+
+int
+xpmem_migrate_busy(struct xpmem_segment *seg, u64 seg_vaddr)
+{
+	return 0;
+}
+
+void
+xpmem_migrate_wait(struct xpmem_segment *seg)
+{
+}
+
+void
+xpmem_migrate_show(struct seq_file *seq, struct xpmem_segment *seg)
+{
+}
+
+#endif /* XPMEM_HAVE_MIGRATE_VMA */
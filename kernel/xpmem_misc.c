@@ -103,6 +103,7 @@ xpmem_tg_deref(struct xpmem_thread_group *tg)
 	 */
 	put_task_struct(tg->group_leader);
 
+	xpmem_rwsem_free(&tg->recall_PFNs_sema);
 	kfree(tg);
 }
 
@@ -153,6 +154,8 @@ xpmem_seg_deref(struct xpmem_segment *seg)
 	 */
 	DBUG_ON(!(seg->flags & XPMEM_FLAG_DESTROYING));
 
+	xpmem_rwsem_free(&seg->sema);
+	kfree(seg->migrate);
 	kfree(seg);
 }
 
@@ -224,11 +227,102 @@ xpmem_att_deref(struct xpmem_attachment *att)
 		 * Attach has been removed from lookup lists and is no
 		 * longer being referenced so it is safe to remove it.
 		 */
-		DBUG_ON(!(att->flags & XPMEM_FLAG_DESTROYING));
+		DBUG_ON(!xpmem_att_test_flag(att, XPMEM_FLAG_DESTROYING));
+		kfree(att->placed);
 		kfree(att);
 	}
 }
 
+/*
+ * Set up and tear down a struct xpmem_rwsem. Freeing is safe from atomic
+ * context so the final deref of the owning structure can happen anywhere.
+ */
+int
+xpmem_rwsem_init(struct xpmem_rwsem *sem)
+{
+	sem->readers = alloc_percpu(int);
+	if (sem->readers == NULL)
+		return -ENOMEM;
+
+	atomic_set(&sem->writers, 0);
+	mutex_init(&sem->write_mutex);
+	init_waitqueue_head(&sem->read_wq);
+	init_waitqueue_head(&sem->write_wq);
+	return 0;
+}
+
+void
+xpmem_rwsem_free(struct xpmem_rwsem *sem)
+{
+	free_percpu(sem->readers);
+	sem->readers = NULL;
+}
+
+/*
+ * Slow path of xpmem_rwsem_down_read_trylock(): sleep until no writer
+ * holds or waits for the semaphore.
+ */
+void
+xpmem_rwsem_down_read(struct xpmem_rwsem *sem)
+{
+	while (!xpmem_rwsem_down_read_trylock(sem))
+		wait_event(sem->read_wq, atomic_read(&sem->writers) == 0);
+}
+
+/*
+ * The per-CPU counts are only meaningful as a sum. A reader may take the
+ * semaphore on one CPU and release it on another.
+ */
+static int
+xpmem_rwsem_readers(struct xpmem_rwsem *sem)
+{
+	int cpu, sum = 0;
+
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(sem->readers, cpu);
+
+	return sum;
+}
+
+/*
+ * Keep new readers out and wait for the current ones to leave. Any number of
+ * callers may block readers at the same time; readers get back in once all of
+ * them have called xpmem_rwsem_unblock_readers().
+ */
+void
+xpmem_rwsem_block_readers(struct xpmem_rwsem *sem)
+{
+	atomic_inc(&sem->writers);
+	/* pairs with the barriers in the read side fast paths */
+	smp_mb__after_atomic();
+
+	wait_event(sem->write_wq, xpmem_rwsem_readers(sem) == 0);
+
+	/* keep the readers' critical sections before ours */
+	smp_mb();
+}
+
+void
+xpmem_rwsem_unblock_readers(struct xpmem_rwsem *sem)
+{
+	if (atomic_dec_and_test(&sem->writers))
+		wake_up_all(&sem->read_wq);
+}
+
+void
+xpmem_rwsem_down_write(struct xpmem_rwsem *sem)
+{
+	mutex_lock(&sem->write_mutex);
+	xpmem_rwsem_block_readers(sem);
+}
+
+void
+xpmem_rwsem_up_write(struct xpmem_rwsem *sem)
+{
+	xpmem_rwsem_unblock_readers(sem);
+	mutex_unlock(&sem->write_mutex);
+}
+
 /*
  * Acquire read access to a xpmem_segment structure.
  */
@@ -244,18 +338,18 @@ xpmem_seg_down_read(struct xpmem_thread_group *seg_tg,
 			return ret;
 	}
 
-	if (!down_read_trylock(&seg->sema)) {
+	if (!xpmem_rwsem_down_read_trylock(&seg->sema)) {
 		if (!wait) {
 			if (block_recall_PFNs)
 				xpmem_unblock_recall_PFNs(seg_tg);
 			return -EAGAIN;
 		}
-		down_read(&seg->sema);
+		xpmem_rwsem_down_read(&seg->sema);
 	}
 
 	if ((seg->flags & XPMEM_FLAG_DESTROYING) ||
 	    (seg_tg->flags & XPMEM_FLAG_DESTROYING)) {
-		up_read(&seg->sema);
+		xpmem_rwsem_up_read(&seg->sema);
 		if (block_recall_PFNs)
 			xpmem_unblock_recall_PFNs(seg_tg);
 		return -ENOENT;
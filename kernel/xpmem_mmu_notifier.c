@@ -23,37 +23,56 @@
 #include "xpmem_internal.h"
 #include "xpmem_private.h"
 
-static inline void
+/*
+ * Clear the consumers' PTEs of seg_tg's segments within [start, end) of
+ * seg_tg's address space.
+ */
+void
 xpmem_invalidate_PTEs_range(struct xpmem_thread_group *seg_tg,
 			    unsigned long start, unsigned long end)
 {
-	struct xpmem_segment *seg;
-	u64 seg_start, seg_end;
+	struct xpmem_segment *seg, *next;
+
+	smp_mb();	/* pairs with xpmem_att_invalidate_begin() */
+	if (start >= end || !xpmem_tg_range_mapped(seg_tg, start, end))
+		return;
 
 	read_lock(&seg_tg->seg_list_lock);
-	list_for_each_entry(seg, &seg_tg->seg_list, seg_list) {
-		if (!(seg->flags & XPMEM_FLAG_DESTROYING)) {
-			seg_start = seg->vaddr;
-			seg_end = seg->vaddr + seg->size;
-
-			if (start <= seg_end && end >= seg_start) {
-				XPMEM_DEBUG("start=%lx, end=%lx", start, end);
-				xpmem_seg_ref(seg);
-				read_unlock(&seg_tg->seg_list_lock);
-
-				xpmem_clear_PTEs_range(seg, start, end, 1);
-
-				read_lock(&seg_tg->seg_list_lock);
-				if (list_empty(&seg->seg_list)) {
-					/* seg was deleted from seg_tg->seg_list */
-					xpmem_seg_deref(seg);
-					seg = list_entry(&seg_tg->seg_list,
-							 struct xpmem_segment,
-							 seg_list);
-				} else
-					xpmem_seg_deref(seg);
-			}
+	seg = xpmem_seg_tree_iter_first(&seg_tg->seg_tree, start, end - 1);
+	while (seg != NULL) {
+		/*
+		 * Attachments of XPMEM_MAKE_PIN segments map the pages pinned
+		 * at make time no matter what happens to the source's PTEs.
+		 */
+		if ((seg->flags & XPMEM_FLAG_DESTROYING) ||
+		    (seg->make_flags & XPMEM_MAKE_PIN) ||
+		    atomic_read(&seg->n_att_mapped) == 0) {
+			seg = xpmem_seg_tree_iter_next(seg, start, end - 1);
+			continue;
 		}
+
+		/*
+		 * Faults that looked up pages of the range before this but
+		 * map them after seg's atts were cleared see the sequence
+		 * move and unmap them again.
+		 */
+		atomic_inc(&seg->invalidate_seq);
+
+		XPMEM_DEBUG("start=%lx, end=%lx", start, end);
+		xpmem_seg_ref(seg);
+		read_unlock(&seg_tg->seg_list_lock);
+
+		xpmem_clear_PTEs_range(seg, start, end, 1);
+
+		read_lock(&seg_tg->seg_list_lock);
+		if (RB_EMPTY_NODE(&seg->seg_node)) {
+			/* seg was removed from seg_tg->seg_tree, start over */
+			next = xpmem_seg_tree_iter_first(&seg_tg->seg_tree,
+							 start, end - 1);
+		} else
+			next = xpmem_seg_tree_iter_next(seg, start, end - 1);
+		xpmem_seg_deref(seg);
+		seg = next;
 	}
 	read_unlock(&seg_tg->seg_list_lock);
 }
@@ -89,18 +108,45 @@ xpmem_invalidate_range(struct mmu_notifier *mn,
 		    start, end);
 
 	/*
-	 * This invalidate callout came from a destination address space
-	 * and we can return because we have already done all the necessary
-	 * invalidate operations.
+	 * The callout comes from whichever task changes the source's page
+	 * tables: the source itself, but also reclaim, khugepaged, kcompactd,
+	 * process_madvise() or a consumer fault breaking COW. All of them
+	 * leave consumers mapping stale pages, so none are skipped. Only the
+	 * OOM reaper can't wait for the locks taken below; the source is being
+	 * torn down then anyway.
 	 */
-	if (seg_tg->tgid != current->tgid)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	if (!mmu_notifier_range_blockable(mnr))
+		return;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	if (!mnr->blockable)
 		return;
+#endif
 
 	if (offset_in_page(start) != 0)
 		start -= offset_in_page(start);
 	if (offset_in_page(end) != 0)
 		end += PAGE_SIZE - offset_in_page(end);
 
+	/*
+	 * Nothing to do unless a consumer may have the range mapped. The
+	 * source's PTEs were cleared before we look, see
+	 * xpmem_att_invalidate_begin().
+	 */
+	smp_mb();
+	if (!xpmem_tg_range_mapped(seg_tg, start, end))
+		return;
+
+	/*
+	 * Tasks other than the source only reach pages on the LRU, never
+	 * XPMEM-attached memory, and may not hold the source's mmap_lock for
+	 * the vma walk below.
+	 */
+	if (seg_tg->tgid != current->tgid) {
+		xpmem_invalidate_PTEs_range(seg_tg, start, end);
+		return;
+	}
+
 	/* NTH: Changes to the tlb code should have removed the need for gathering
 	 * the mmu here. There is not any state that needs to be restored */
 
@@ -14,9 +14,13 @@
  */
 
 #include <linux/efi.h>
+#include <linux/highmem.h>
 #include <linux/pagemap.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "xpmem_internal.h"
 #include "xpmem_private.h"
 
@@ -172,24 +176,28 @@ xpmem_vaddr_to_pte_offset(struct mm_struct *mm, u64 vaddr, u64 *offset)
 }
 
 /*
- * This is similar to xpmem_vaddr_to_pte_offset, except it should
- * only be used for areas mapped with base pages. Specifically, it is used
- * for XPMEM attachments since we know XPMEM created those mappings with base
- * pages. The size argument is used to determine at which level of the page
- * tables an invalid entry was found. This is used by xpmem_unpin_pages. size
- * must always be a valid pointer.
+ * This is similar to xpmem_vaddr_to_pte_offset, except it is used for XPMEM
+ * attachments where we know how the mappings were created: either with base
+ * pages or, when XPMEM_HAVE_HUGE_FAULT is defined, with PMD/PUD sized PFN
+ * mappings. If the PMD of vaddr points to a table of PTEs it is returned.
+ * Otherwise NULL is returned, and size holds the size of the huge mapping
+ * found, whose first PFN is stored in pfn, or the size of the hole found at
+ * some level of the page tables, for which pfn is set to -1UL. This is used
+ * by xpmem_unpin_pages. size and pfn must always be valid pointers.
  */
-static pte_t *
-xpmem_vaddr_to_pte_size(struct mm_struct *mm, u64 vaddr, u64 *size)
+static pmd_t *
+xpmem_attach_vaddr_to_pmd(struct mm_struct *mm, u64 vaddr, u64 *pfn,
+			  u64 *size)
 {
 	pgd_t *pgd;
 	pud_t *pud;
 	pmd_t *pmd;
-	pte_t *pte;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
 	p4d_t *p4d;
 #endif
 
+	*pfn = -1UL;
+
 	pgd = pgd_offset(mm, vaddr);
 	if (!pgd_present(*pgd)) {
 		*size = PGDIR_SIZE;
@@ -202,7 +210,7 @@ xpmem_vaddr_to_pte_size(struct mm_struct *mm, u64 vaddr, u64 *size)
 	if (!p4d_present(*p4d)) {
 		*size = P4D_SIZE;
 		return NULL;
-        }
+	}
 
 	pud = pud_offset(p4d, vaddr);
 #else
@@ -212,164 +220,930 @@ xpmem_vaddr_to_pte_size(struct mm_struct *mm, u64 vaddr, u64 *size)
 		*size = PUD_SIZE;
 		return NULL;
 	}
+#if defined(XPMEM_HAVE_HUGE_FAULT) && \
+    defined(CONFIG_HAVE_ARCH_TRANSPARENT_HUGEPAGE_PUD)
+	if (pud_trans_huge(*pud) || pud_devmap(*pud)) {
+		*pfn = pud_pfn(*pud);
+		*size = PUD_SIZE;
+		return NULL;
+	}
+#endif
 	pmd = pmd_offset(pud, vaddr);
 	if (!pmd_present(*pmd)) {
 		*size = PMD_SIZE;
 		return NULL;
 	}
-
-	pte = pte_offset_map(pmd, vaddr);
-	if (!pte_present(*pte)) {
-		*size = PAGE_SIZE;
+#ifdef XPMEM_HAVE_HUGE_FAULT
+	if (pmd_trans_huge(*pmd) || pmd_devmap(*pmd)) {
+		*pfn = pmd_pfn(*pmd);
+		*size = PMD_SIZE;
 		return NULL;
 	}
-	return pte;
+#endif
+	*size = PMD_SIZE;
+	return pmd;
+}
+
+/*
+ * Version independent wrapper around get_user_pages_remote().
+ */
+static long
+xpmem_gup_remote(struct task_struct *src_task, struct mm_struct *src_mm,
+		 u64 vaddr, unsigned long nr_pages, unsigned int gup_flags,
+		 struct page **pages)
+{
+#if   LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	return get_user_pages_remote (src_mm, vaddr, nr_pages, gup_flags, pages,
+				      NULL, NULL);
+#elif   LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	return get_user_pages_remote (src_task, src_mm, vaddr, nr_pages,
+				      gup_flags, pages, NULL, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+	return get_user_pages_remote (src_task, src_mm, vaddr, nr_pages,
+				      gup_flags, pages, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+	return get_user_pages_remote (src_task, src_mm, vaddr, nr_pages,
+				      gup_flags, 0, pages, NULL);
+#else
+	return get_user_pages (src_task, src_mm, vaddr, nr_pages, gup_flags, 0,
+			       pages, NULL);
+#endif
 }
 
 /*
- * Fault in and pin a single page for the specified task and mm.
+ * Fault in and pin up to nr_pages consecutive pages for the specified task
+ * and mm. The range is clipped to the source vma containing vaddr. The pages
+ * are only faulted in for writing if write is set. Pages of ranges attached
+ * from other thread groups are pinned through the attachment, which chain
+ * lists the attachments already being resolved through for. Returns the
+ * number of pages pinned (at least one) or a negative errno.
  */
 static int
-xpmem_pin_page(struct xpmem_thread_group *tg, struct task_struct *src_task,
-		struct mm_struct *src_mm, u64 vaddr, unsigned long *pfn)
+xpmem_pin_pages(struct xpmem_thread_group *tg, struct task_struct *src_task,
+		struct mm_struct *src_mm, u64 vaddr, int nr_pages,
+		unsigned long *pfns, int write, struct xpmem_chain *chain)
 {
-	int ret;
-	struct page *page;
+	int i, ret;
+	struct page *pages[XPMEM_FAULT_AROUND_MAX];
 	struct vm_area_struct *vma;
-	cpumask_t saved_mask = CPU_MASK_NONE;
 	int foll_write;
 
+	DBUG_ON(nr_pages <= 0 || nr_pages > XPMEM_FAULT_AROUND_MAX);
+
 	vma = find_vma(src_mm, vaddr);
 	if (!vma || vma->vm_start > vaddr)
 		return -ENOENT;
 
-	/* don't pin pages in address ranges attached from other thread groups */
-	if (xpmem_is_vm_ops_set(vma))
-		return -ENOENT;
+	/* get_user_pages() can only walk one source vma at a time for us */
+	nr_pages = min_t(int, nr_pages, (vma->vm_end - vaddr) >> PAGE_SHIFT);
 
 	/*
-	 * get_user_pages() may have to allocate pages on behalf of
-	 * the source thread group. If so, we want to ensure that pages
-	 * are allocated near the source thread group and not the current
-	 * thread calling get_user_pages(). Since this does not happen when
-	 * the policy is node-local (the most common default policy),
-	 * we might have to temporarily switch cpus to get the page
-	 * placed where we want it.
+	 * Map with write permissions only if source VMA is writeable and the
+	 * attachment is not read-only. A read fault leaves untouched anonymous
+	 * source memory mapped to the shared zero page instead of allocating
+	 * it.
 	 */
-	if (xpmem_vaddr_to_pte_offset(src_mm, vaddr, NULL) == NULL &&
-	    cpu_to_node(task_cpu(current)) != cpu_to_node(task_cpu(src_task))) {
-#ifdef HAVE_STRUCT_TASK_STRUCT_CPUS_MASK
-		saved_mask = current->cpus_mask;
-#else
-		saved_mask = current->cpus_allowed;
-#endif
-		set_cpus_allowed_ptr(current, cpumask_of(task_cpu(src_task)));
-	}
+	foll_write = (write && (vma->vm_flags & VM_WRITE)) ? FOLL_WRITE : 0;
 
-	/* Map with write permissions only if source VMA is writeable */
-	foll_write = (vma->vm_flags & VM_WRITE) ? FOLL_WRITE : 0;
-
-	/* get_user_pages()/get_user_pages_remote() faults and pins the page */
-#if   LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
-	ret = get_user_pages_remote (src_mm, vaddr, 1, foll_write, &page, NULL,
-				     NULL);
-#elif   LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
-	ret = get_user_pages_remote (src_task, src_mm, vaddr, 1, foll_write,
-				     &page, NULL, NULL);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
-	ret = get_user_pages_remote (src_task, src_mm, vaddr, 1, foll_write,
-				     &page, NULL);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
-	ret = get_user_pages_remote (src_task, src_mm, vaddr, 1, foll_write, 0,
-				     &page, NULL);
-#else
-	ret = get_user_pages (src_task, src_mm, vaddr, 1, foll_write, 0, &page,
-			      NULL);
-#endif
-	if (!cpumask_empty(&saved_mask))
-		set_cpus_allowed_ptr(current, &saved_mask);
+	if (xpmem_is_vm_ops_set(vma)) {
+		ret = xpmem_pin_attached(vma, vaddr, nr_pages, pfns,
+					 !!foll_write, chain);
+	} else {
+		/* get_user_pages()/get_user_pages_remote() faults and pins */
+		ret = xpmem_gup_remote(src_task, src_mm, vaddr, nr_pages,
+				       foll_write, pages);
+		for (i = 0; i < ret; i++)
+			pfns[i] = page_to_pfn(pages[i]);
+	}
 
-	if (ret == 1) {
-		*pfn = page_to_pfn(page);
-		atomic_inc(&tg->n_pinned);
-		atomic_inc(&xpmem_my_part->n_pinned);
-		ret = 0;
+	if (ret > 0) {
+		atomic_add(ret, &tg->n_pinned);
+		atomic_add(ret, &xpmem_my_part->n_pinned);
+	} else if (ret == 0) {
+		ret = -EFAULT;
 	}
 
 	return ret;
 }
 
+#define XPMEM_UNPIN_BATCH	32	/* pages released at once */
+
+/*
+ * Drop the references held on the n_pages pages in pages. Older kernels'
+ * release_pages() mishandles ZONE_DEVICE pages, so they are put one by one.
+ */
+static void
+xpmem_put_pages(struct page **pages, int n_pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	release_pages(pages, n_pages);
+#else
+	int i;
+
+	for (i = 0; i < n_pages; i++)
+		xpmem_put_page(pages[i]);
+#endif
+}
+
 /*
- * Unpin all pages in the given range for the specified mm.
+ * Unpin all pages in the given range for the specified mm. A huge mapping
+ * that overlaps the range is unpinned in its entirety since zapping any part
+ * of it removes the whole mapping. Each table of PTEs is looked up once and
+ * walked linearly, and the pages found are released XPMEM_UNPIN_BATCH at a
+ * time.
  */
 void
 xpmem_unpin_pages(struct xpmem_segment *seg, struct mm_struct *mm,
 			u64 vaddr, size_t size)
 {
-	int n_pgs = num_of_pages(vaddr, size);
-	int n_pgs_unpinned = 0;
-	struct page *page;
-	u64 pfn, vsize = 0;
-	pte_t *pte = NULL;
+	long n_pgs = num_of_pages(vaddr, size);
+	long n_pgs_unpinned = 0;
+	struct page *pages[XPMEM_UNPIN_BATCH];
+	int n_batch = 0;
+	pmd_t *pmd;
+	pte_t *pte, *ptep;
+	u64 pfn, i, end, next, vsize;
 
-	XPMEM_DEBUG("vaddr=%llx, size=%lx, n_pgs=%d", vaddr, size, n_pgs);
+	XPMEM_DEBUG("vaddr=%llx, size=%lx, n_pgs=%ld", vaddr, size, n_pgs);
 
 	/* Round down to the nearest page aligned address */
 	vaddr &= PAGE_MASK;
+	end = vaddr + ((u64)n_pgs << PAGE_SHIFT);
 
-	while (n_pgs > 0) {
-		pte = xpmem_vaddr_to_pte_size(mm, vaddr, &vsize);
-
-		if (pte) {
-			DBUG_ON(!pte_present(*pte));
-			pfn = pte_pfn(*pte);
-			XPMEM_DEBUG("pfn=%llx, vaddr=%llx, n_pgs=%d",
-					pfn, vaddr, n_pgs);
-			page = virt_to_page(__va(pfn << PAGE_SHIFT));
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
-			put_page(page);
-#else
-			page_cache_release(page);
-#endif
+	while (vaddr < end) {
+		pmd = xpmem_attach_vaddr_to_pmd(mm, vaddr, &pfn, &vsize);
+
+		/*
+		 * vsize holds the memory size that is either mapped by a
+		 * single entry, covered by the table of PTEs found or known
+		 * not to be mapped, based on which level of the page tables
+		 * the walk stopped at. We round up to the next address that
+		 * could have another entry.
+		 */
+		next = (vaddr + vsize) & ~(vsize - 1);
+
+		if (pmd == NULL) {
+			if (pfn != -1UL) {
+				XPMEM_DEBUG("pfn=%llx, vaddr=%llx, size=%llx",
+					    pfn, vaddr, vsize);
+				for (i = 0; i < (vsize >> PAGE_SHIFT); i++) {
+					pages[n_batch++] = pfn_to_page(pfn + i);
+					if (n_batch == XPMEM_UNPIN_BATCH) {
+						xpmem_put_pages(pages, n_batch);
+						n_batch = 0;
+					}
+				}
+				n_pgs_unpinned += vsize >> PAGE_SHIFT;
+			}
+			vaddr = next;
+			continue;
+		}
+
+		next = min(next, end);
+		pte = pte_offset_map(pmd, vaddr);
+		if (pte == NULL) {
+			/* the table went away under us, nothing is mapped */
+			vaddr = next;
+			continue;
+		}
+		for (ptep = pte; vaddr < next; vaddr += PAGE_SIZE, ptep++) {
+			if (!pte_present(*ptep))
+				continue;
+			pages[n_batch++] = pte_page(*ptep);
 			n_pgs_unpinned++;
-			vaddr += PAGE_SIZE;
-			n_pgs--;
-		} else {
-			/*
-			 * vsize holds the memory size we know isn't mapped,
-			 * based on which level of the page tables had an
-			 * invalid entry. We round up to the nearest address
-			 * that could have valid pages and find how many pages
-			 * we skipped.
-			 */
-			vsize = ((vaddr + vsize) & (~(vsize - 1)));
-			n_pgs -= (vsize - vaddr)/PAGE_SIZE;
-			vaddr = vsize;
+			/* releasing pages never sleeps, the PTEs can stay mapped */
+			if (n_batch == XPMEM_UNPIN_BATCH) {
+				xpmem_put_pages(pages, n_batch);
+				n_batch = 0;
+			}
 		}
+		pte_unmap(pte);
 	}
 
+	if (n_batch > 0)
+		xpmem_put_pages(pages, n_batch);
+
 	atomic_sub(n_pgs_unpinned, &seg->tg->n_pinned);
 	atomic_add(n_pgs_unpinned, &xpmem_my_part->n_unpinned);
 }
 
 /*
- * Given a virtual address and XPMEM segment, pin the page.
+ * Given a virtual address and XPMEM segment, pin up to nr_pages consecutive
+ * pages starting at that address, for writing if write is set. chain is
+ * passed on to xpmem_pin_attached() if the segment is made over attachments.
+ * Returns the number of pages pinned or a negative errno.
  */
 int
-xpmem_ensure_valid_PFN(struct xpmem_segment *seg, u64 vaddr, unsigned long *pfn)
+xpmem_ensure_valid_PFNs_chained(struct xpmem_segment *seg, u64 vaddr,
+				int nr_pages, unsigned long *pfns, int write,
+				struct xpmem_chain *chain)
 {
-  int ret;
 	struct xpmem_thread_group *seg_tg = seg->tg;
 
 	/* the seg may have been marked for destruction while we were down() */
-        if (seg->flags & XPMEM_FLAG_DESTROYING)
+	if (seg->flags & XPMEM_FLAG_DESTROYING)
+		return -ENOENT;
+
+	/* never pin beyond the end of the segment */
+	nr_pages = min_t(u64, nr_pages,
+			 (seg->vaddr + seg->size - vaddr) >> PAGE_SHIFT);
+	if (nr_pages <= 0)
+		return -EINVAL;
+
+	/* pin PFNs */
+	return xpmem_pin_pages(seg_tg, seg_tg->group_leader, seg_tg->mm, vaddr,
+			       nr_pages, pfns, write, chain);
+}
+
+int
+xpmem_ensure_valid_PFNs(struct xpmem_segment *seg, u64 vaddr, int nr_pages,
+			unsigned long *pfns, int write)
+{
+	return xpmem_ensure_valid_PFNs_chained(seg, vaddr, nr_pages, pfns,
+					       write, NULL);
+}
+
+/*
+ * Check that flags name at most one XPMEM_PLACE_* policy and, for
+ * XPMEM_PLACE_NODE(), an online node.
+ */
+int
+xpmem_place_valid(int flags)
+{
+	int place = flags & XPMEM_PLACE_MASK;
+	int nid = xpmem_place_nid(flags);
+
+	if (place == XPMEM_PLACE_ON_NODE)
+		return nid < MAX_NUMNODES && node_online(nid);
+
+	return place <= XPMEM_PLACE_INTERLEAVE && nid == 0;
+}
+
+/*
+ * Return the node that place asks for the source page at vaddr, or
+ * NUMA_NO_NODE if the page should come from the faulting thread's node.
+ * Interleaving goes by PMD range, which neither a fault-around window nor a
+ * populate step ever crosses.
+ */
+static int
+xpmem_place_node(struct xpmem_segment *seg, int place, u64 vaddr)
+{
+	int nid, n;
+
+	switch (place & XPMEM_PLACE_MASK) {
+	case XPMEM_PLACE_CONSUMER:
+		return NUMA_NO_NODE;
+	case XPMEM_PLACE_INTERLEAVE:
+		n = (vaddr >> PMD_SHIFT) % num_online_nodes();
+		for_each_online_node(nid) {
+			if (n-- == 0)
+				return nid;
+		}
+		return NUMA_NO_NODE;
+	case XPMEM_PLACE_ON_NODE:
+		return xpmem_place_nid(place);
+	default:
+		return cpu_to_node(task_cpu(seg->tg->group_leader));
+	}
+}
+
+struct xpmem_place_work {
+	struct work_struct work;
+	struct xpmem_thread_group *tg;
+	u64 vaddr;
+	int nr_pages;
+	int write;
+};
+
+/*
+ * Fault in a source range from a worker running on the target node, so that
+ * pages allocated for it come from that node under the default local
+ * allocation policy. Nothing is pinned; the pages are looked up again by
+ * the caller.
+ */
+static void
+xpmem_place_worker(struct work_struct *work)
+{
+	struct xpmem_place_work *pw = container_of(work,
+					struct xpmem_place_work, work);
+	struct mm_struct *mm = pw->tg->mm;
+	struct page *pages[XPMEM_FAULT_AROUND_MAX];
+	struct vm_area_struct *vma;
+	u64 vaddr = pw->vaddr;
+	u64 end = vaddr + ((u64)pw->nr_pages << PAGE_SHIFT);
+	unsigned int foll_write;
+	long i, nr, ret;
+
+	/* the consumer holds locks the source's writers may be waiting on */
+	if (!xpmem_mmap_read_trylock(mm))
+		return;
+
+	while (vaddr < end) {
+		vma = find_vma(mm, vaddr);
+		if (!vma || vma->vm_start > vaddr || xpmem_is_vm_ops_set(vma))
+			break;
+
+		foll_write = (pw->write && (vma->vm_flags & VM_WRITE)) ?
+			     FOLL_WRITE : 0;
+		nr = min_t(u64, XPMEM_FAULT_AROUND_MAX,
+			   (min_t(u64, end, vma->vm_end) - vaddr) >> PAGE_SHIFT);
+		ret = xpmem_gup_remote(pw->tg->group_leader, mm, vaddr, nr,
+				       foll_write, pages);
+		if (ret <= 0)
+			break;
+
+		for (i = 0; i < ret; i++)
+			xpmem_put_page(pages[i]);
+		vaddr += ret << PAGE_SHIFT;
+	}
+
+	xpmem_mmap_read_unlock(mm);
+}
+
+/*
+ * Get source pages that a consumer is about to touch for the first time
+ * allocated on the node its placement policy asks for, rather than on the
+ * node of the consumer thread that would otherwise fault them in. The caller
+ * must not hold the source's or the consumer's mmap_sem/mmap_lock, as this
+ * waits for the worker. Attachments only call it once per PMD range, see
+ * xpmem_att_place_pages(). It is best effort: the range is left alone if
+ * the source's lock is contended or if the node has no CPUs to run a worker on.
+ */
+void
+xpmem_place_pages(struct xpmem_segment *seg, int place, u64 vaddr,
+		  int nr_pages, int write)
+{
+	struct mm_struct *mm = seg->tg->mm;
+	struct xpmem_place_work pw;
+	int i, nid, holes = 0;
+
+	nid = xpmem_place_node(seg, place, vaddr);
+	if (nid == NUMA_NO_NODE || nid == numa_node_id() ||
+	    !node_state(nid, N_CPU))
+		return;
+
+	/* only hand the range off if something in it has to be allocated */
+	if (!xpmem_mmap_read_trylock(mm))
+		return;
+	for (i = 0; i < nr_pages && !holes; i++)
+		holes = (xpmem_vaddr_to_pte_offset(mm, vaddr + ((u64)i <<
+						   PAGE_SHIFT), NULL) == NULL);
+	xpmem_mmap_read_unlock(mm);
+	if (!holes)
+		return;
+
+	pw.tg = seg->tg;
+	pw.vaddr = vaddr;
+	pw.nr_pages = nr_pages;
+	pw.write = write;
+	INIT_WORK_ONSTACK(&pw.work, xpmem_place_worker);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	queue_work_node(nid, xpmem_wq, &pw.work);
+#else
+	queue_work_on(cpumask_any_and(cpumask_of_node(nid), cpu_online_mask),
+		      xpmem_wq, &pw.work);
+#endif
+	flush_work(&pw.work);
+	destroy_work_on_stack(&pw.work);
+}
+
+#if defined(CONFIG_MMU_GATHER_RCU_TABLE_FREE) || defined(CONFIG_HAVE_RCU_TABLE_FREE)
+#if defined(CONFIG_ARCH_HAS_PTE_DEVMAP) || defined(__HAVE_ARCH_PTE_DEVMAP)
+#define xpmem_pte_devmap(_pte)	pte_devmap(_pte)
+#else
+#define xpmem_pte_devmap(_pte)	0
+#endif
+
+/*
+ * Pin up to nr_pages consecutive pages of the source that are already mapped
+ * without taking its mmap_sem/mmap_lock. If write is set they also have to be
+ * mapped writable and dirty. PROT_NONE and NUMA hinting PTEs, which are
+ * present on some architectures, and ZONE_DEVICE pages, which need their
+ * pgmap held, are left to get_user_pages() as well. As in
+ * get_user_pages_fast(), the page tables are walked with interrupts disabled,
+ * which keeps page table pages from being freed under us since they are
+ * freed via RCU on this configuration, and a page is only kept if its PTE did
+ * not change while the reference was taken. Stops at the first page that
+ * needs get_user_pages() and at the end of the page table. Returns the number
+ * of pages pinned.
+ */
+static int
+xpmem_pin_pages_fast(struct xpmem_thread_group *tg, u64 vaddr, int nr_pages,
+		     unsigned long *pfns, int write)
+{
+	unsigned long flags;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmdp, pmd;
+	pte_t *ptep, pte;
+	struct page *page;
+	int i = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+	p4d_t *p4d;
+#endif
+
+	nr_pages = min_t(u64, nr_pages,
+			 ((vaddr & PMD_MASK) + PMD_SIZE - vaddr) >> PAGE_SHIFT);
+
+	local_irq_save(flags);
+
+	pgd = pgd_offset(tg->mm, vaddr);
+	if (!pgd_present(READ_ONCE(*pgd)))
+		goto out;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+	p4d = p4d_offset(pgd, vaddr);
+	if (!p4d_present(READ_ONCE(*p4d)))
+		goto out;
+	pud = pud_offset(p4d, vaddr);
+#else
+	pud = pud_offset(pgd, vaddr);
+#endif
+	if (!pud_present(READ_ONCE(*pud)))
+		goto out;
+#if CONFIG_HUGETLB_PAGE
+	if (pud_is_huge(READ_ONCE(*pud)))
+		goto out;
+#endif
+
+	/* huge source pages are left to the slow path */
+	pmdp = pmd_offset(pud, vaddr);
+	pmd = READ_ONCE(*pmdp);
+	if (!pmd_present(pmd) || pmd_trans_huge(pmd) || pmd_protnone(pmd))
+		goto out;
+#if CONFIG_HUGETLB_PAGE
+	if (pmd_is_huge(pmd))
+		goto out;
+#endif
+
+	ptep = pte_offset_map(&pmd, vaddr);
+	if (ptep == NULL)
+		goto out;
+
+	for (; i < nr_pages; i++) {
+		pte = READ_ONCE(ptep[i]);
+
+		/* COW breaking and dirtying is left to get_user_pages() */
+		if (!pte_present(pte) || pte_protnone(pte) ||
+		    pte_special(pte) || xpmem_pte_devmap(pte) ||
+		    (write && (!pte_write(pte) || !pte_dirty(pte))) ||
+		    !pfn_valid(pte_pfn(pte)))
+			break;
+
+		page = pte_page(pte);
+		if (PageCompound(page) || !get_page_unless_zero(page))
+			break;
+
+		if (unlikely(pte_val(pte) != pte_val(READ_ONCE(ptep[i])) ||
+			     pmd_val(pmd) != pmd_val(READ_ONCE(*pmdp)))) {
+			xpmem_put_page(page);
+			break;
+		}
+
+		pfns[i] = page_to_pfn(page);
+	}
+	pte_unmap(ptep);
+out:
+	local_irq_restore(flags);
+
+	if (i > 0) {
+		atomic_add(i, &tg->n_pinned);
+		atomic_add(i, &xpmem_my_part->n_pinned);
+	}
+	return i;
+}
+#endif
+
+/*
+ * Like xpmem_ensure_valid_PFNs() but only pins pages that can be pinned
+ * without the source's mmap_sem/mmap_lock, so the caller does not need to
+ * hold it. Returns the number of pages pinned, 0 if the slow path has to be
+ * used.
+ */
+int
+xpmem_ensure_valid_PFNs_fast(struct xpmem_segment *seg, u64 vaddr,
+			     int nr_pages, unsigned long *pfns, int write)
+{
+#if defined(CONFIG_MMU_GATHER_RCU_TABLE_FREE) || defined(CONFIG_HAVE_RCU_TABLE_FREE)
+	if (seg->flags & XPMEM_FLAG_DESTROYING)
+		return 0;
+
+	nr_pages = min_t(u64, nr_pages,
+			 (seg->vaddr + seg->size - vaddr) >> PAGE_SHIFT);
+	if (nr_pages <= 0)
+		return 0;
+
+	return xpmem_pin_pages_fast(seg->tg, vaddr, nr_pages, pfns, write);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * The pins of XPMEM_MAKE_PIN and sealed segments last as long as the segment.
+ * Where the kernel can take long-term pins on a remote mm, they are taken as
+ * FOLL_PIN | FOLL_LONGTERM: that moves the pages out of ZONE_MOVABLE and CMA
+ * first, and makes fork() copy them for the child rather than share them
+ * copy-on-write, so the source keeps the pages the consumers map.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define xpmem_seg_gup(_tg, _vaddr, _nr, _flags, _pages)			\
+	pin_user_pages_remote((_tg)->mm, _vaddr, _nr,			\
+			      (_flags) | FOLL_LONGTERM, _pages, NULL)
+#define xpmem_seg_put_page(_page)	unpin_user_page(_page)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#define xpmem_seg_gup(_tg, _vaddr, _nr, _flags, _pages)			\
+	pin_user_pages_remote((_tg)->mm, _vaddr, _nr,			\
+			      (_flags) | FOLL_LONGTERM, _pages, NULL, NULL)
+#define xpmem_seg_put_page(_page)	unpin_user_page(_page)
+#else
+#define xpmem_seg_gup(_tg, _vaddr, _nr, _flags, _pages)			\
+	xpmem_gup_remote((_tg)->group_leader, (_tg)->mm, _vaddr, _nr,	\
+			 _flags, _pages)
+#define xpmem_seg_put_page(_page)	xpmem_put_page(_page)
+#endif
+
+/*
+ * Pin every page of a XPMEM_MAKE_PIN segment once and record the PFNs in
+ * seg->pfns. Faults on the segment's attachments then look the PFNs up in
+ * the table instead of walking the source's page tables, and don't take
+ * references of their own. Called by xpmem_make() before the segment can be
+ * found by anyone else, and by xpmem_seal() with the segment write-locked
+ * and its attachments' PTEs cleared. Fails if part of the range is not mapped.
+ * The source's mmap_lock is dropped between page tables, so a large segment
+ * doesn't hold off the source's own mmap() and munmap() for long.
+ */
+int
+xpmem_seg_pin_pages(struct xpmem_segment *seg)
+{
+	struct xpmem_thread_group *seg_tg = seg->tg;
+	unsigned long nr_pages = seg->size >> PAGE_SHIFT, pinned = 0, batch, i;
+	unsigned int foll_flags;
+	struct vm_area_struct *vma;
+	struct page **pages;
+	long ret = 0;
+	u64 vaddr;
+
+	/* the range could never be pinned, and n_pinned is an atomic_t */
+	if (nr_pages > totalram_pages() || nr_pages > INT_MAX)
+		return -ENOMEM;
+
+	seg->pfns = vzalloc(array_size(nr_pages, sizeof(unsigned long)));
+	if (seg->pfns == NULL)
+		return -ENOMEM;
+
+	pages = kmalloc_array(PTRS_PER_PTE, sizeof(struct page *), GFP_KERNEL);
+	if (pages == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (pinned < nr_pages) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		/* the vma is looked up again every time the lock was dropped */
+		xpmem_mmap_read_lock(seg_tg->mm);
+		vaddr = seg->vaddr + (pinned << PAGE_SHIFT);
+		vma = find_vma(seg_tg->mm, vaddr);
+		if (!vma || vma->vm_start > vaddr || xpmem_is_vm_ops_set(vma)) {
+			xpmem_mmap_read_unlock(seg_tg->mm);
+			ret = -EFAULT;
+			break;
+		}
+
+		/* Map with write permissions only if source VMA is writeable */
+		foll_flags = (vma->vm_flags & VM_WRITE) ? FOLL_WRITE : 0;
+
+		batch = min_t(unsigned long, nr_pages - pinned, PTRS_PER_PTE);
+		batch = min_t(unsigned long, batch,
+			      (vma->vm_end - vaddr) >> PAGE_SHIFT);
+		ret = xpmem_seg_gup(seg_tg, vaddr, batch, foll_flags, pages);
+		xpmem_mmap_read_unlock(seg_tg->mm);
+		if (ret <= 0) {
+			ret = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < ret; i++)
+			seg->pfns[pinned + i] = page_to_pfn(pages[i]);
+		pinned += ret;
+		ret = 0;
+		cond_resched();
+	}
+	kfree(pages);
+
+	if (ret == 0) {
+		atomic_add(nr_pages, &seg_tg->n_pinned);
+		atomic_add(nr_pages, &xpmem_my_part->n_pinned);
+		return 0;
+	}
+
+	for (i = 0; i < pinned; i++)
+		xpmem_seg_put_page(pfn_to_page(seg->pfns[i]));
+out:
+	vfree(seg->pfns);
+	seg->pfns = NULL;
+	return ret;
+}
+
+/*
+ * Set up the per node tables of copies of a segment's pinned pages for
+ * XPMEM_ATTACH_REPLICATE. The tables themselves are allocated on first use.
+ */
+int
+xpmem_seg_alloc_replicas(struct xpmem_segment *seg)
+{
+	seg->replicas = kcalloc(nr_node_ids, sizeof(unsigned long *),
+				GFP_KERNEL);
+	return (seg->replicas == NULL) ? -ENOMEM : 0;
+}
+
+static void
+xpmem_seg_free_replicas(struct xpmem_segment *seg)
+{
+	unsigned long nr_pages = seg->size >> PAGE_SHIFT, i;
+	int nid, n_freed = 0;
+
+	if (seg->replicas == NULL)
+		return;
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		if (seg->replicas[nid] == NULL)
+			continue;
+		for (i = 0; i < nr_pages; i++) {
+			if (seg->replicas[nid][i]) {
+				__free_page(pfn_to_page(seg->replicas[nid][i]));
+				n_freed++;
+			}
+			if ((i & (PTRS_PER_PTE - 1)) == PTRS_PER_PTE - 1)
+				cond_resched();
+		}
+		vfree(seg->replicas[nid]);
+	}
+	atomic_sub(n_freed, &xpmem_my_part->n_replicas);
+	kfree(seg->replicas);
+	seg->replicas = NULL;
+}
+
+/*
+ * Replace nr_pages PFNs of a sealed segment, as looked up for vaddr by
+ * xpmem_seg_lookup_PFNs(), with the PFNs of copies on node nid. Missing
+ * copies are made now. Since the source promised not to write a sealed
+ * range, a copy never goes stale. Pages that already are on nid, and pages
+ * that cannot be copied, are left alone. Copies are charged to the faulting
+ * task's memory cgroup, and no more than xpmem_replica_max_pages of them
+ * exist at any time; past that, faults map the original pages. The caller
+ * holds the fault lock of an attachment, which keeps xpmem_remove_seg() from
+ * freeing the copies.
+ */
+void
+xpmem_seg_replicate_PFNs(struct xpmem_segment *seg, u64 vaddr, int nr_pages,
+			 unsigned long *pfns, int nid)
+{
+	unsigned long idx = (vaddr - seg->vaddr) >> PAGE_SHIFT, pfn, *table;
+	struct page *page;
+	int i;
+
+	if (seg->replicas == NULL)
+		return;
+
+	table = READ_ONCE(seg->replicas[nid]);
+	if (table == NULL) {
+		table = vzalloc_node(array_size(seg->size >> PAGE_SHIFT,
+						sizeof(unsigned long)), nid);
+		if (table == NULL)
+			return;
+		if (cmpxchg(&seg->replicas[nid], NULL, table) != NULL) {
+			vfree(table);
+			table = READ_ONCE(seg->replicas[nid]);
+		}
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		pfn = READ_ONCE(table[idx + i]);
+		if (pfn == 0) {
+			if (is_zero_pfn(pfns[i]) ||
+			    page_to_nid(pfn_to_page(pfns[i])) == nid)
+				continue;
+
+			if (atomic_inc_return(&xpmem_my_part->n_replicas) >
+			    READ_ONCE(xpmem_replica_max_pages)) {
+				atomic_dec(&xpmem_my_part->n_replicas);
+				break;
+			}
+
+			page = alloc_pages_node(nid, GFP_HIGHUSER |
+						__GFP_ACCOUNT | __GFP_THISNODE |
+						__GFP_NOWARN, 0);
+			if (page == NULL) {
+				atomic_dec(&xpmem_my_part->n_replicas);
+				continue;
+			}
+			copy_highpage(page, pfn_to_page(pfns[i]));
+
+			/* another attachment may have copied it meanwhile */
+			pfn = cmpxchg(&table[idx + i], 0, page_to_pfn(page));
+			if (pfn != 0) {
+				__free_page(page);
+				atomic_dec(&xpmem_my_part->n_replicas);
+			} else {
+				pfn = page_to_pfn(page);
+			}
+		}
+		pfns[i] = pfn;
+	}
+}
+
+/*
+ * Drop the pins taken by xpmem_seg_pin_pages(). The caller holds the seg
+ * write-locked and has already cleared the PTEs of all its attachments.
+ */
+void
+xpmem_seg_unpin_pages(struct xpmem_segment *seg)
+{
+	unsigned long nr_pages = seg->size >> PAGE_SHIFT, i;
+
+	if (seg->pfns == NULL)
+		return;
+
+	for (i = 0; i < nr_pages; i++) {
+		xpmem_seg_put_page(pfn_to_page(seg->pfns[i]));
+		if ((i & (PTRS_PER_PTE - 1)) == PTRS_PER_PTE - 1)
+			cond_resched();
+	}
+	atomic_sub(nr_pages, &seg->tg->n_pinned);
+	atomic_add(nr_pages, &xpmem_my_part->n_unpinned);
+
+	vfree(seg->pfns);
+	seg->pfns = NULL;
+
+	xpmem_seg_free_replicas(seg);
+}
+
+/*
+ * Copy up to nr_pages PFNs of a XPMEM_MAKE_PIN segment starting at vaddr into
+ * pfns. The caller holds the seg read-locked, which keeps the table from
+ * being freed. Returns the number of PFNs copied.
+ */
+int
+xpmem_seg_lookup_PFNs(struct xpmem_segment *seg, u64 vaddr, int nr_pages,
+		      unsigned long *pfns)
+{
+	unsigned long idx;
+	int i;
+
+	if ((seg->flags & XPMEM_FLAG_DESTROYING) || seg->pfns == NULL)
+		return 0;
+
+	nr_pages = min_t(u64, nr_pages,
+			 (seg->vaddr + seg->size - vaddr) >> PAGE_SHIFT);
+	idx = (vaddr - seg->vaddr) >> PAGE_SHIFT;
+	for (i = 0; i < nr_pages; i++)
+		pfns[i] = seg->pfns[idx + i];
+
+	return max(nr_pages, 0);
+}
+
+#ifdef XPMEM_HAVE_HUGE_FAULT
+/*
+ * Return the size of the page backing vaddr in the source mm. hugetlb pages
+ * are reported even if they have not been faulted in yet since the vma fixes
+ * their size. Returns 0 if vaddr is not mapped by a vma. The FOLL_* flags to
+ * pin the page with are returned in foll_flags.
+ */
+static u64
+xpmem_src_page_size(struct mm_struct *mm, u64 vaddr, unsigned int *foll_flags)
+{
+	struct vm_area_struct *vma;
+	pgd_t *pgd;
+	p4d_t *p4d;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	vma = find_vma(mm, vaddr);
+	if (!vma || vma->vm_start > vaddr || xpmem_is_vm_ops_set(vma))
+		return 0;
+
+	/* Map with write permissions only if source VMA is writeable */
+	*foll_flags = (vma->vm_flags & VM_WRITE) ? FOLL_WRITE : 0;
+
+	if (is_vm_hugetlb_page(vma))
+		return huge_page_size(hstate_vma(vma));
+
+	pgd = pgd_offset(mm, vaddr);
+	if (!pgd_present(*pgd))
+		return PAGE_SIZE;
+	p4d = p4d_offset(pgd, vaddr);
+	if (!p4d_present(*p4d))
+		return PAGE_SIZE;
+	pud = pud_offset(p4d, vaddr);
+	if (!pud_present(*pud))
+		return PAGE_SIZE;
+	if (pud_is_huge(*pud))
+		return PUD_SIZE;
+	pmd = pmd_offset(pud, vaddr);
+	if (pmd_present(*pmd) && pmd_is_huge(*pmd))
+		return PMD_SIZE;
+
+	return PAGE_SIZE;
+}
+
+/*
+ * Given a huge page aligned virtual address in the XPMEM segment, pin the
+ * 1 << order base pages that make up a single huge source page. Fails with
+ * -EAGAIN if the source is not backed by a huge page of at least that size,
+ * in which case the caller is expected to fall back to base pages. On success
+ * the first PFN is returned in pfn. Each base page holds its own reference
+ * so that xpmem_unpin_pages() can release them individually. The pages are
+ * only pinned for writing if write is set.
+ */
+int
+xpmem_ensure_valid_huge_PFN(struct xpmem_segment *seg, u64 vaddr,
+			    unsigned int order, unsigned long *pfn, int write)
+{
+	struct xpmem_thread_group *seg_tg = seg->tg;
+	unsigned long nr_pages = 1UL << order, batch, pinned = 0, i;
+	unsigned int foll_flags = 0;
+	struct page **pages;
+	long ret = 0;
+
+	if (seg->flags & XPMEM_FLAG_DESTROYING)
 		return -ENOENT;
 
-	/* pin PFN */
-	ret = xpmem_pin_page(seg_tg, seg_tg->group_leader, seg_tg->mm, vaddr, pfn);
+	if (vaddr + (nr_pages << PAGE_SHIFT) > seg->vaddr + seg->size)
+		return -EAGAIN;
+
+	if (xpmem_src_page_size(seg_tg->mm, vaddr, &foll_flags) <
+	    (PAGE_SIZE << order))
+		return -EAGAIN;
+	if (!write)
+		foll_flags &= ~FOLL_WRITE;
+
+	batch = min_t(unsigned long, nr_pages, PTRS_PER_PTE);
+	pages = kmalloc_array(batch, sizeof(struct page *), GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+
+	while (pinned < nr_pages) {
+		batch = min_t(unsigned long, nr_pages - pinned, PTRS_PER_PTE);
+		ret = xpmem_gup_remote(seg_tg->group_leader, seg_tg->mm,
+				       vaddr + (pinned << PAGE_SHIFT), batch,
+				       foll_flags, pages);
+		if (ret <= 0) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		for (i = 0; i < ret; i++) {
+			if (pinned == 0 && i == 0)
+				*pfn = page_to_pfn(pages[0]);
+			if (page_to_pfn(pages[i]) != *pfn + pinned + i)
+				break;
+		}
 
+		/* release anything that is not part of the contiguous run */
+		if (i < ret) {
+			for (; i < ret; i++)
+				xpmem_put_page(pages[i]);
+			ret = -EAGAIN;
+		}
+
+		pinned += i;
+		if (ret < 0)
+			break;
+		ret = 0;
+	}
+
+	if (ret == 0 && (*pfn & (nr_pages - 1)) != 0)
+		ret = -EAGAIN;
+
+	if (ret != 0) {
+		for (i = 0; i < pinned; i++)
+			xpmem_put_page(pfn_to_page(*pfn + i));
+	} else {
+		atomic_add(nr_pages, &seg_tg->n_pinned);
+		atomic_add(nr_pages, &xpmem_my_part->n_pinned);
+	}
+
+	kfree(pages);
 	return ret;
 }
+#endif /* XPMEM_HAVE_HUGE_FAULT */
+
+/*
+ * Given a virtual address and XPMEM segment, pin the page.
+ */
+int
+xpmem_ensure_valid_PFN(struct xpmem_segment *seg, u64 vaddr, unsigned long *pfn)
+{
+	int ret;
+
+	ret = xpmem_ensure_valid_PFNs(seg, vaddr, 1, pfn, 1);
+
+	return (ret < 0) ? ret : 0;
+}
 
 /*
  * Return the PFN for a given virtual address.
@@ -433,7 +1207,12 @@ xpmem_recall_PFNs_of_tg(struct xpmem_thread_group *seg_tg)
 
 	read_lock(&seg_tg->seg_list_lock);
 	list_for_each_entry(seg, &seg_tg->seg_list, seg_list) {
-		if (!(seg->flags & XPMEM_FLAG_DESTROYING)) {
+		/*
+		 * Consumers of XPMEM_MAKE_PIN and sealed segments would only
+		 * refault the pages pinned by the segment itself.
+		 */
+		if (!(seg->flags & XPMEM_FLAG_DESTROYING) &&
+		    !(seg->make_flags & XPMEM_MAKE_PIN)) {
 			xpmem_seg_ref(seg);
 			read_unlock(&seg_tg->seg_list_lock);
 
@@ -453,76 +1232,40 @@ xpmem_recall_PFNs_of_tg(struct xpmem_thread_group *seg_tg)
 	read_unlock(&seg_tg->seg_list_lock);
 }
 
+/*
+ * Faults that pin source pages hold tg->recall_PFNs_sema for reading so
+ * that xpmem_fork_begin() can wait for them and keep new ones out until
+ * xpmem_fork_end().
+ */
 int
 xpmem_block_recall_PFNs(struct xpmem_thread_group *tg, int wait)
 {
-	int value, returned_value;
-
-	while (1) {
-		if (waitqueue_active(&tg->allow_recall_PFNs_wq))
-			goto wait;
-
-		value = atomic_read(&tg->n_recall_PFNs);
-		while (1) {
-			if (unlikely(value > 0))
-				break;
-
-			returned_value = atomic_cmpxchg(&tg->n_recall_PFNs,
-							value, value - 1);
-			if (likely(returned_value == value))
-				break;
+	if (xpmem_rwsem_down_read_trylock(&tg->recall_PFNs_sema))
+		return 0;
 
-			value = returned_value;
-		}
+	if (!wait)
+		return -EAGAIN;
 
-		if (value <= 0)
-			return 0;
-wait:
-		if (!wait)
-			return -EAGAIN;
-
-		wait_event(tg->block_recall_PFNs_wq,
-			   (atomic_read(&tg->n_recall_PFNs) <= 0));
-	}
+	xpmem_rwsem_down_read(&tg->recall_PFNs_sema);
+	return 0;
 }
 
 void
 xpmem_unblock_recall_PFNs(struct xpmem_thread_group *tg)
 {
-	if (atomic_inc_return(&tg->n_recall_PFNs) == 0)
-			wake_up(&tg->allow_recall_PFNs_wq);
+	xpmem_rwsem_up_read(&tg->recall_PFNs_sema);
 }
 
 static void
 xpmem_disallow_blocking_recall_PFNs(struct xpmem_thread_group *tg)
 {
-	int value, returned_value;
-
-	while (1) {
-		value = atomic_read(&tg->n_recall_PFNs);
-		while (1) {
-			if (unlikely(value < 0))
-				break;
-			returned_value = atomic_cmpxchg(&tg->n_recall_PFNs,
-							value, value + 1);
-			if (likely(returned_value == value))
-				break;
-			value = returned_value;
-		}
-
-		if (value >= 0)
-			return;
-
-		wait_event(tg->allow_recall_PFNs_wq,
-			  (atomic_read(&tg->n_recall_PFNs) >= 0));
-	}
+	xpmem_rwsem_block_readers(&tg->recall_PFNs_sema);
 }
 
 static void
 xpmem_allow_blocking_recall_PFNs(struct xpmem_thread_group *tg)
 {
-	if (atomic_dec_return(&tg->n_recall_PFNs) == 0)
-		wake_up(&tg->block_recall_PFNs_wq);
+	xpmem_rwsem_unblock_readers(&tg->recall_PFNs_sema);
 }
 
 int
@@ -614,17 +1357,26 @@ xpmem_unpin_procfs_show(struct seq_file *seq, void *offset)
 {
 	pid_t tgid = (unsigned long)seq->private;
 	struct xpmem_thread_group *tg;
+	struct xpmem_segment *seg;
 
 	if (tgid == 0) {
 		seq_printf(seq, "all pages pinned by XPMEM: %d\n"
-				"all pages unpinned by XPMEM: %d\n",
+				"all pages unpinned by XPMEM: %d\n"
+				"all pages of XPMEM replicas: %d\n",
 				 atomic_read(&xpmem_my_part->n_pinned),
-				 atomic_read(&xpmem_my_part->n_unpinned));
+				 atomic_read(&xpmem_my_part->n_unpinned),
+				 atomic_read(&xpmem_my_part->n_replicas));
 	} else {
 		tg = xpmem_tg_ref_by_tgid(tgid);
 		if (!IS_ERR(tg)) {
 			seq_printf(seq, "pages pinned by XPMEM: %d\n",
 				   atomic_read(&tg->n_pinned));
+			read_lock(&tg->seg_list_lock);
+			list_for_each_entry(seg, &tg->seg_list, seg_list) {
+				if (seg->migrate)
+					xpmem_migrate_show(seq, seg);
+			}
+			read_unlock(&tg->seg_list_lock);
 			xpmem_tg_deref(tg);
 		}
 	}
@@ -19,12 +19,15 @@
 
 #include <linux/version.h>
 #include <linux/bit_spinlock.h>
+#include <linux/log2.h>
 #include <linux/sched.h>
 #include <linux/hugetlb.h>
+#include <linux/percpu.h>
 #include <asm/signal.h>
 
 #ifdef CONFIG_MMU_NOTIFIER
 #include <linux/mmu_notifier.h>
+#include <linux/rbtree.h>
 #else
 #error "Kernel needs to be configured with CONFIG_MMU_NOTIFIER"
 #endif /* CONFIG_MMU_NOTIFIER */
@@ -59,6 +62,7 @@
  *     2.6.3  Fix bugs introduced in 2.6.2 that worked with 3.x but
  *            not 4.x kernels.
  *     2.6.4  Fix hold-and-wait deadlock on detach.
+ *     2.7    Add make and attach flags, xpmem_seal() and xpmem_prefetch().
  *
  * This int constant has the following format:
  *
@@ -69,11 +73,82 @@
  *       major - major revision number (12-bits)
  *       minor - minor revision number (16-bits)
  */
-#define XPMEM_CURRENT_VERSION		0x00026005
-#define XPMEM_CURRENT_VERSION_STRING	"2.6.5"
+#define XPMEM_CURRENT_VERSION		0x00027000
+#define XPMEM_CURRENT_VERSION_STRING	"2.7.0"
 
 #define XPMEM_MODULE_NAME "xpmem"
 
+/*
+ * Attachments can be mapped with PMD/PUD sized entries when the source is
+ * backed by huge pages. This needs the vm_fault based huge PFN insertion
+ * interface.
+ */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && defined(CONFIG_HUGETLB_PAGE) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+#define XPMEM_HAVE_HUGE_FAULT 1
+#endif
+
+/*
+ * XPMEM_ATTACH_NOPIN attachments track the source range with an interval
+ * notifier and look up source pages with hmm_range_fault().
+ */
+#if IS_ENABLED(CONFIG_HMM_MIRROR) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#define XPMEM_HAVE_HMM 1
+#endif
+
+/*
+ * XPMEM_MAKE_MIGRATE segments move source pages between nodes with the
+ * migrate_vma interface.
+ */
+#if (IS_ENABLED(CONFIG_DEVICE_PRIVATE) || \
+     IS_ENABLED(CONFIG_DEVICE_MIGRATION)) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#define XPMEM_HAVE_MIGRATE_VMA 1
+#endif
+
+/*
+ * XPMEM_ATTACH_PAGES attachments are VM_MIXEDMAP, which zap_vma_ptes()
+ * refuses to touch, so their PTEs are zapped through the /dev/xpmem mapping
+ * instead. Each one gets a private range of mmap offsets starting at
+ * XPMEM_PAGES_PGOFF, above any user address that other attachments use as
+ * their offset.
+ */
+#if defined(CONFIG_64BIT) && IS_ENABLED(CONFIG_ARCH_HAS_PTE_SPECIAL) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+#define XPMEM_HAVE_ATTACH_PAGES 1
+#define XPMEM_PAGES_PGOFF	((1UL << (BITS_PER_LONG - 2)) >> PAGE_SHIFT)
+#define xpmem_is_pages_pgoff(_pgoff)	((_pgoff) >= XPMEM_PAGES_PGOFF)
+#else
+#define xpmem_is_pages_pgoff(_pgoff)	0
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+typedef int vm_fault_t;
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+#define mmgrab(_mm)		atomic_inc(&(_mm)->mm_count)
+#define mmget_not_zero(_mm)	atomic_inc_not_zero(&(_mm)->mm_users)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+#define array_size(_a, _b)	\
+	(((_b) != 0 && (_a) > SIZE_MAX / (_b)) ? SIZE_MAX : (_a) * (_b))
+#define struct_size(_p, _member, _n)	\
+	(sizeof(*(_p)) + array_size(_n, sizeof(*(_p)->_member)))
+#else
+#include <linux/overflow.h>
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+#define totalram_pages()	totalram_pages
+#endif
+
+#ifndef __GFP_ACCOUNT
+#define __GFP_ACCOUNT		0
+#endif
+
 #ifdef USE_DBUG_ON
 #define DBUG_ON(condition)      BUG_ON(condition)
 #else
@@ -81,6 +156,12 @@
 #endif
 
 extern uint32_t xpmem_debug_on;
+extern unsigned int xpmem_fault_around_pages;
+extern unsigned int xpmem_migrate_interval_ms;
+extern unsigned int xpmem_attach_wait_ms;
+extern unsigned int xpmem_invalidate_fanout;
+extern unsigned int xpmem_replica_max_pages;
+extern struct workqueue_struct *xpmem_wq;
 
 #define XPMEM_DEBUG(format, a...)					\
 	if (xpmem_debug_on)						\
@@ -159,6 +240,32 @@ xpmem_ap_hashtable_index(xpmem_apid_t apid)
  * general internal driver structures
  */
 
+/*
+ * Reader/writer semaphore whose read side only touches a per-CPU counter
+ * while no writer is around, so faults from many CPUs on one segment don't
+ * bounce a shared cacheline. Writers are rare (segment removal and recall
+ * of PFNs around fork) and pay for summing the per-CPU counters instead.
+ */
+struct xpmem_rwsem {
+	int __percpu *readers;		/* per-CPU count of readers */
+	atomic_t writers;		/* writers holding or waiting for sem */
+	struct mutex write_mutex;	/* serializes exclusive writers */
+	wait_queue_head_t read_wq;	/* readers waiting for writers */
+	wait_queue_head_t write_wq;	/* writers waiting for readers */
+};
+
+/*
+ * Segments are indexed by address range in an interval tree per thread
+ * group. Older kernels have no cached rbtree root.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
+#define xpmem_rb_root		rb_root
+#define XPMEM_RB_ROOT		RB_ROOT
+#else
+#define xpmem_rb_root		rb_root_cached
+#define XPMEM_RB_ROOT		RB_ROOT_CACHED
+#endif
+
 struct xpmem_thread_group {
 	spinlock_t lock;	/* tg lock */
 	pid_t tgid;		/* tg's tgid */
@@ -174,16 +281,20 @@ struct xpmem_thread_group {
 	atomic_t uniq_apid;
 	rwlock_t seg_list_lock;
 	struct list_head seg_list;	/* tg's list of segs */
+	struct xpmem_rb_root seg_tree;	/* tg's segs by address range,
+					 * protected by seg_list_lock */
+	atomic_t n_att_mapped;	/* atts with valid PTEs of tg's segs */
+	u64 mapped_start;	/* source range covering those atts, */
+	u64 mapped_end;		/* only valid while n_att_mapped != 0 */
 	atomic_t refcnt;	/* references to tg */
 	atomic_t n_pinned;	/* #of pages pinned by this tg */
 	u64 addr_limit;		/* highest possible user addr */
 	struct list_head tg_hashlist;	/* tg hash list */
 	struct task_struct *group_leader;	/* thread group leader */
 	struct mm_struct *mm;	/* tg's mm */
-	atomic_t n_recall_PFNs;	/* #of recall of PFNs in progress */
+	struct xpmem_rwsem recall_PFNs_sema;	/* read-locked to block recall
+						 * of PFNs */
 	struct mutex recall_PFNs_mutex;	/* lock for serializing recall of PFNs */
-	wait_queue_head_t block_recall_PFNs_wq;	/* wait to block recall of PFNs */
-	wait_queue_head_t allow_recall_PFNs_wq;	/* wait to allow recall of PFNs */
 	struct mmu_notifier mmu_not;	/* tg's mmu notifier struct */
 	int mmu_initialized;	/* registered for mmu callbacks? */
 	int mmu_unregister_called;
@@ -193,18 +304,29 @@ struct xpmem_thread_group {
 
 struct xpmem_segment {
 	spinlock_t lock;	/* seg lock */
-	struct rw_semaphore sema;	/* seg sema */
+	struct xpmem_rwsem sema;	/* seg sema */
 	xpmem_segid_t segid;	/* unique segid */
 	u64 vaddr;		/* starting address */
 	size_t size;		/* size of seg */
 	int permit_type;	/* permission scheme */
 	void *permit_value;	/* permission data */
 	volatile int flags;	/* seg attributes and state */
+	int make_flags;		/* XPMEM_MAKE_* flags given at make time */
+	unsigned long *pfns;	/* PFNs pinned by XPMEM_MAKE_PIN */
+	unsigned long **replicas;	/* per node PFNs of copies of pfns,
+					 * only for sealed segs */
+	struct xpmem_migrate *migrate;	/* XPMEM_MAKE_MIGRATE sampling */
 	atomic_t refcnt;	/* references to seg */
 	wait_queue_head_t destroyed_wq;	/* wait for seg to be destroyed */
 	struct xpmem_thread_group *tg;	/* creator tg */
 	struct list_head ap_list;	/* local access permits of seg */
+	struct xpmem_rb_root att_tree;	/* atts of seg by source range,
+					 * protected by lock */
+	atomic_t n_att_mapped;	/* atts of seg with valid PTEs */
+	atomic_t invalidate_seq;	/* bumped by invalidations reaching atts */
 	struct list_head seg_list;	/* tg's list of segs */
+	struct rb_node seg_node;	/* tg's interval tree of segs */
+	u64 seg_subtree_last;	/* highest address in seg_node's subtree */
 };
 
 struct xpmem_access_permit {
@@ -220,24 +342,55 @@ struct xpmem_access_permit {
 	struct list_head ap_hashlist;	/* access permit hash list */
 };
 
+#define XPMEM_ATT_FAULT_LOCKS	16	/* hashed per-range fault locks */
+
 struct xpmem_attachment {
 	struct mutex mutex;	/* att lock for serialization */
 	u64 vaddr;		/* starting address of seg attached */
 	u64 at_vaddr;		/* address where seg is attached */
 	size_t at_size;		/* size of seg attachment */
 	struct vm_area_struct *at_vma;	/* vma where seg is attachment */
-	volatile int flags;	/* att attributes and state */
+	unsigned long flags;	/* att attributes and state, see xpmem_att_*_flag() */
+	int attach_flags;	/* XPMEM_ATTACH_* flags given at attach time */
+	int place;		/* XPMEM_PLACE_* policy in effect */
+	unsigned long *placed;	/* source PMD ranges placed, if any */
+	unsigned int fault_window;	/* current fault-around size in pages */
+	u64 fault_next;		/* vaddr following the last fault-around */
+	struct xpmem_populate_work *prefetch;	/* queued xpmem_prefetch(),
+						 * under mutex */
 	atomic_t refcnt;	/* references to att */
 	struct xpmem_access_permit *ap;/* associated access permit */
 	struct list_head att_list;	/* atts linked to access permit */
+	struct rb_node att_node;	/* seg's interval tree of atts */
+	u64 att_subtree_last;	/* highest address in att_node's subtree */
 	struct mm_struct *mm;	/* mm struct attached to */
 	struct mutex invalidate_mutex; /* to serialize page table invalidates */
+	struct mutex fault_mutex[XPMEM_ATT_FAULT_LOCKS]; /* serialize faults
+							  * per PMD range */
+#ifdef XPMEM_HAVE_HMM
+	struct mmu_interval_notifier notifier; /* source range, only used by
+						* XPMEM_ATTACH_NOPIN */
+#endif
+};
+
+/*
+ * Segments may be made over XPMEM attachments. Pinning one of their pages
+ * resolves through each attachment in turn up to the page's owner. The
+ * attachments a pin is currently being resolved through are kept in a list
+ * on the stack, innermost first, to stop cyclic and overly long chains.
+ */
+struct xpmem_chain {
+	struct xpmem_chain *prev;	/* attachment resolved through before */
+	struct xpmem_attachment *att;	/* attachment being resolved through */
 };
 
+#define XPMEM_MAX_CHAIN		4	/* attachments a pin may pass through */
+
 struct xpmem_partition {
 	/* procfs debugging */
 	atomic_t n_pinned; 	/* # of pages pinned xpmem */
 	atomic_t n_unpinned; 	/* # of pages unpinned by xpmem */
+	atomic_t n_replicas;	/* # of pages holding segment replicas */
 
 	struct xpmem_hashlist tg_hashtable[];	/* locks + tg hash lists */
 };
@@ -252,21 +405,82 @@ struct xpmem_partition {
 
 #define XPMEM_FLAG_VALIDPTEs		0x00200	/* valid PTEs exist */
 #define XPMEM_FLAG_RECALLINGPFNS	0x00400	/* recalling PFNs */
+#define XPMEM_FLAG_SEALED		0x00800	/* seg sealed by xpmem_seal() */
+
+/*
+ * att->flags is updated by concurrent per-range faults and VMA-locked faults
+ * that hold neither att->mutex nor the mmap_lock for writing, so it is only
+ * ever changed with atomic bitops.
+ */
+#define xpmem_att_test_flag(a, f)	test_bit(ilog2(f), &(a)->flags)
+#define xpmem_att_set_flag(a, f)	set_bit(ilog2(f), &(a)->flags)
+#define xpmem_att_clear_flag(a, f)	clear_bit(ilog2(f), &(a)->flags)
+#define xpmem_att_test_and_set_flag(a, f)	\
+	test_and_set_bit(ilog2(f), &(a)->flags)
+#define xpmem_att_test_and_clear_flag(a, f)	\
+	test_and_clear_bit(ilog2(f), &(a)->flags)
 
 #define	XPMEM_DONT_USE_1		0x10000
 #define	XPMEM_DONT_USE_2		0x20000
 #define	XPMEM_DONT_USE_3		0x40000	/* reserved for xpmem.h */
 #define	XPMEM_DONT_USE_4		0x80000	/* reserved for xpmem.h */
 
+/* XPMEM_PLACE_* policy and node bits, checked by xpmem_place_valid() */
+#define XPMEM_PLACE_FLAGS		(XPMEM_PLACE_MASK | \
+					 (0x7fff << XPMEM_PLACE_NODE_SHIFT))
+#define XPMEM_PLACE_ON_NODE		(XPMEM_PLACE_NODE(0) & XPMEM_PLACE_MASK)
+#define xpmem_place_nid(_place)		(((_place) & XPMEM_PLACE_FLAGS) >> \
+					 XPMEM_PLACE_NODE_SHIFT)
+
+/* all XPMEM_MAKE_* flags accepted by xpmem_make() */
+#define XPMEM_MAKE_VALID_FLAGS		(XPMEM_MAKE_PIN | XPMEM_MAKE_MIGRATE | \
+					 XPMEM_PLACE_FLAGS)
+
+/* all XPMEM_ATTACH_* flags accepted by xpmem_attach() */
+#define XPMEM_ATTACH_VALID_FLAGS	(XPMEM_ATTACH_NOFAULTAROUND | \
+					 XPMEM_ATTACH_POPULATE | \
+					 XPMEM_ATTACH_RDONLY | \
+					 XPMEM_ATTACH_NOPIN | \
+					 XPMEM_ATTACH_REPLICATE | \
+					 XPMEM_ATTACH_PAGES | \
+					 XPMEM_ATTACH_WAIT | \
+					 XPMEM_ATTACH_SAMEVA | \
+					 XPMEM_PLACE_FLAGS)
+
+/*
+ * XPMEM_ATTACH_POPULATE hands each worker at least XPMEM_POPULATE_CHUNK of
+ * the attachment, using at most XPMEM_POPULATE_MAX_WORKERS workers.
+ */
+#define XPMEM_POPULATE_CHUNK		(64UL << 20)
+#define XPMEM_POPULATE_MAX_WORKERS	16
+
+/*
+ * Fault-around: each fault on an attachment pins and maps a window of up to
+ * XPMEM_FAULT_AROUND_MAX pages. The window doubles while faults are
+ * sequential and halves on random access. The fault_around_pages module
+ * parameter caps the window below XPMEM_FAULT_AROUND_MAX.
+ */
+#define XPMEM_FAULT_AROUND_MAX		32
+#define XPMEM_FAULT_AROUND_DEFAULT	16
+
 #define XPMEM_NODE_UNINITIALIZED	-1
 #define XPMEM_CPUS_UNINITIALIZED	-1
 #define XPMEM_NODE_OFFLINE		-2
 #define XPMEM_CPUS_OFFLINE		-2
 
 /* found in xpmem_make.c */
-extern int xpmem_make(u64, size_t, int, void *, xpmem_segid_t *);
+extern int xpmem_make(u64, size_t, int, void *, int, xpmem_segid_t *);
+extern int xpmem_seal(xpmem_segid_t);
 extern void xpmem_remove_segs_of_tg(struct xpmem_thread_group *);
 extern int xpmem_remove(xpmem_segid_t);
+extern void xpmem_seg_tree_insert(struct xpmem_segment *,
+				  struct xpmem_rb_root *);
+extern void xpmem_seg_tree_remove(struct xpmem_segment *,
+				  struct xpmem_rb_root *);
+extern struct xpmem_segment *xpmem_seg_tree_iter_first(struct xpmem_rb_root *,
+						       u64, u64);
+extern struct xpmem_segment *xpmem_seg_tree_iter_next(struct xpmem_segment *,
+						      u64, u64);
 
 /* found in xpmem_get.c */
 extern int xpmem_get(xpmem_segid_t, int, int, void *, xpmem_apid_t *);
@@ -279,13 +493,50 @@ extern int xpmem_attach(struct file *, xpmem_apid_t, off_t, size_t, u64, int,
 			int, u64 *);
 extern void xpmem_clear_PTEs_range(struct xpmem_segment *, u64, u64, int);
 extern void xpmem_clear_PTEs(struct xpmem_segment *);
+extern void xpmem_seg_fault_barrier(struct xpmem_segment *);
+extern int xpmem_pin_attached(struct vm_area_struct *, u64, int,
+			      unsigned long *, int, struct xpmem_chain *);
 extern int xpmem_detach(u64);
+extern int xpmem_prefetch(u64, size_t);
 extern void xpmem_detach_att(struct xpmem_access_permit *,
 			     struct xpmem_attachment *);
 extern int xpmem_mmap(struct file *, struct vm_area_struct *);
+#ifdef XPMEM_HAVE_HUGE_FAULT
+extern unsigned long xpmem_get_unmapped_area(struct file *, unsigned long,
+					     unsigned long, unsigned long,
+					     unsigned long);
+#endif
+
+/* found in xpmem_migrate.c */
+struct seq_file;
+extern int xpmem_migrate_init(struct xpmem_segment *);
+extern void xpmem_migrate_sample(struct xpmem_segment *, u64, unsigned long);
+extern int xpmem_migrate_busy(struct xpmem_segment *, u64);
+extern void xpmem_migrate_wait(struct xpmem_segment *);
+extern void xpmem_migrate_show(struct seq_file *, struct xpmem_segment *);
 
 /* found in xpmem_pfn.c */
 extern int xpmem_ensure_valid_PFN(struct xpmem_segment *, u64, unsigned long *);
+extern int xpmem_ensure_valid_PFNs(struct xpmem_segment *, u64, int,
+				   unsigned long *, int);
+extern int xpmem_ensure_valid_PFNs_chained(struct xpmem_segment *, u64, int,
+					   unsigned long *, int,
+					   struct xpmem_chain *);
+extern int xpmem_ensure_valid_PFNs_fast(struct xpmem_segment *, u64, int,
+					unsigned long *, int);
+#ifdef XPMEM_HAVE_HUGE_FAULT
+extern int xpmem_ensure_valid_huge_PFN(struct xpmem_segment *, u64,
+				       unsigned int, unsigned long *, int);
+#endif
+extern int xpmem_place_valid(int);
+extern void xpmem_place_pages(struct xpmem_segment *, int, u64, int, int);
+extern int xpmem_seg_pin_pages(struct xpmem_segment *);
+extern void xpmem_seg_unpin_pages(struct xpmem_segment *);
+extern int xpmem_seg_alloc_replicas(struct xpmem_segment *);
+extern void xpmem_seg_replicate_PFNs(struct xpmem_segment *, u64, int,
+				     unsigned long *, int);
+extern int xpmem_seg_lookup_PFNs(struct xpmem_segment *, u64, int,
+				 unsigned long *);
 extern u64 xpmem_vaddr_to_PFN(struct mm_struct *mm, u64 vaddr);
 extern int xpmem_block_recall_PFNs(struct xpmem_thread_group *, int);
 extern void xpmem_unpin_pages(struct xpmem_segment *, struct mm_struct *, u64,
@@ -344,6 +595,42 @@ static inline struct xpmem_thread_group *__xpmem_tg_ref_by_tgid_nolock(pid_t tgi
 #define xpmem_mmap_read_trylock(_mm)	mmap_read_trylock(_mm)
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+#define xpmem_put_page(_page)	put_page(_page)
+#else
+#define xpmem_put_page(_page)	page_cache_release(_page)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define xpmem_vm_flags_set(_vma, _flags)	vm_flags_set(_vma, _flags)
+#define xpmem_vm_flags_clear(_vma, _flags)	vm_flags_clear(_vma, _flags)
+#else
+#define xpmem_vm_flags_set(_vma, _flags)	((_vma)->vm_flags |= (_flags))
+#define xpmem_vm_flags_clear(_vma, _flags)	((_vma)->vm_flags &= ~(_flags))
+#endif
+
+/*
+ * Faults on attachments may run with only the vma read-locked instead of
+ * the mmap_lock. release_fault_lock() drops whichever lock the fault holds.
+ * Before 6.7 the kernel takes the mmap_lock for every fault on a vma that is
+ * not anonymous. From 6.7 on, huge faults may run under the vma lock, and
+ * base page faults only do so because attachments have a ->map_pages, see
+ * xpmem_map_pages_handler().
+ */
+#if defined(CONFIG_PER_VMA_LOCK) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define XPMEM_HAVE_VMA_LOCK 1
+#define xpmem_fault_vma_locked(_vmf)	((_vmf)->flags & FAULT_FLAG_VMA_LOCK)
+#define xpmem_release_fault_lock(_vmf, _vma)	release_fault_lock(_vmf)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#define XPMEM_HAVE_VMA_MAP_PAGES 1
+#endif
+#else
+#define xpmem_fault_vma_locked(_vmf)	0
+#define xpmem_release_fault_lock(_vmf, _vma)	\
+	xpmem_mmap_read_unlock((_vma)->vm_mm)
+#endif
+
 #if (!HAVE_DECL_VMA_ITER_INIT)
 struct vma_iterator {
 	struct mm_struct *mm;
@@ -380,9 +667,34 @@ extern struct file_operations xpmem_debug_printk_procfs_ops;
 #else
 extern const struct proc_ops xpmem_debug_printk_procfs_ops;
 #endif
+extern int xpmem_rwsem_init(struct xpmem_rwsem *);
+extern void xpmem_rwsem_free(struct xpmem_rwsem *);
+extern void xpmem_rwsem_down_read(struct xpmem_rwsem *);
+extern void xpmem_rwsem_block_readers(struct xpmem_rwsem *);
+extern void xpmem_rwsem_unblock_readers(struct xpmem_rwsem *);
+extern void xpmem_rwsem_down_write(struct xpmem_rwsem *);
+extern void xpmem_rwsem_up_write(struct xpmem_rwsem *);
+
 /* found in xpmem_mmu_notifier.c */
 extern int xpmem_mmu_notifier_init(struct xpmem_thread_group *);
 extern void xpmem_mmu_notifier_unlink(struct xpmem_thread_group *);
+extern void xpmem_invalidate_PTEs_range(struct xpmem_thread_group *,
+					unsigned long, unsigned long);
+
+/*
+ * Tell whether any attachment of seg_tg's segments may have valid PTEs of
+ * source addresses within [start, end). Lets invalidations of ranges that
+ * nobody has mapped return early.
+ */
+static inline int
+xpmem_tg_range_mapped(struct xpmem_thread_group *seg_tg, u64 start, u64 end)
+{
+	if (atomic_read(&seg_tg->n_att_mapped) == 0)
+		return 0;
+	smp_rmb();	/* pairs with xpmem_att_set_validPTEs() */
+	return start < READ_ONCE(seg_tg->mapped_end) &&
+	       end > READ_ONCE(seg_tg->mapped_start);
+}
 
 /*
  * Inlines that mark an internal driver structure as being destroyable or not.
@@ -478,13 +790,48 @@ xpmem_is_vm_ops_set(struct vm_area_struct *vma)
 	return (vma->vm_ops == &xpmem_vm_ops);
 }
 
+/*
+ * Read side fast paths of struct xpmem_rwsem. The slow paths can be found in
+ * xpmem_misc.c.
+ */
+static inline int
+xpmem_rwsem_down_read_trylock(struct xpmem_rwsem *sem)
+{
+	preempt_disable();
+	__this_cpu_inc(*sem->readers);
+	/* pairs with the barrier in xpmem_rwsem_block_readers() */
+	smp_mb();
+	if (likely(atomic_read(&sem->writers) == 0)) {
+		preempt_enable();
+		return 1;
+	}
+	__this_cpu_dec(*sem->readers);
+	preempt_enable();
+
+	/* a writer may be waiting for the count we just dropped */
+	wake_up(&sem->write_wq);
+	return 0;
+}
+
+static inline void
+xpmem_rwsem_up_read(struct xpmem_rwsem *sem)
+{
+	/* keep the critical section before the count drops */
+	smp_mb();
+	this_cpu_dec(*sem->readers);
+	/* pairs with the barrier in xpmem_rwsem_block_readers() */
+	smp_mb();
+	if (unlikely(atomic_read(&sem->writers) != 0))
+		wake_up(&sem->write_wq);
+}
+
 /* xpmem_seg_down_read() can be found in xpmem_misc.c */
 
 static inline void
 xpmem_seg_up_read(struct xpmem_thread_group *seg_tg,
 		  struct xpmem_segment *seg, int unblock_recall_PFNs)
 {
-	up_read(&seg->sema);
+	xpmem_rwsem_up_read(&seg->sema);
 	if (unblock_recall_PFNs)
 		xpmem_unblock_recall_PFNs(seg_tg);
 }
@@ -492,13 +839,13 @@ xpmem_seg_up_read(struct xpmem_thread_group *seg_tg,
 static inline void
 xpmem_seg_down_write(struct xpmem_segment *seg)
 {
-	down_write(&seg->sema);
+	xpmem_rwsem_down_write(&seg->sema);
 }
 
 static inline void
 xpmem_seg_up_write(struct xpmem_segment *seg)
 {
-	up_write(&seg->sema);
+	xpmem_rwsem_up_write(&seg->sema);
 	wake_up(&seg->destroyed_wq);
 }
 
@@ -92,6 +92,22 @@ xpmem_segid_t xpmem_make(void *vaddr, size_t size, int permit_type,
 	return make_info.segid;
 }
 
+xpmem_segid_t xpmem_make_flags(void *vaddr, size_t size, int permit_type,
+			       void *permit_value, int flags)
+{
+	struct xpmem_cmd_make_flags make_info;
+
+	make_info.make.vaddr = (__u64)vaddr;
+	make_info.make.size  = size;
+	make_info.make.permit_type  = permit_type;
+	make_info.make.permit_value = (__u64)permit_value;
+	make_info.flags = flags;
+	if (xpmem_ioctl(XPMEM_CMD_MAKE_FLAGS, &make_info) == -1 ||
+	    !make_info.make.segid)
+		return -1;
+	return make_info.make.segid;
+}
+
 int xpmem_remove(xpmem_segid_t segid)
 {
 	struct xpmem_cmd_remove	remove_info;
@@ -102,6 +118,16 @@ int xpmem_remove(xpmem_segid_t segid)
 	return 0;
 }
 
+int xpmem_seal(xpmem_segid_t segid)
+{
+	struct xpmem_cmd_remove	seal_info;
+
+	seal_info.segid = segid;
+	if (xpmem_ioctl(XPMEM_CMD_SEAL, &seal_info) == -1)
+		return -1;
+	return 0;
+}
+
 xpmem_apid_t xpmem_get(xpmem_segid_t segid, int flags, int permit_type,
 			void *permit_value)
 {
@@ -127,6 +153,12 @@ int xpmem_release(xpmem_apid_t apid)
 }
 
 void *xpmem_attach(struct xpmem_addr addr, size_t size, void *vaddr)
+{
+	return xpmem_attach_flags(addr, size, vaddr, 0);
+}
+
+void *xpmem_attach_flags(struct xpmem_addr addr, size_t size, void *vaddr,
+			 int flags)
 {
 	struct xpmem_cmd_attach attach_info;
 
@@ -135,12 +167,23 @@ void *xpmem_attach(struct xpmem_addr addr, size_t size, void *vaddr)
 	attach_info.size = size;
 	attach_info.vaddr = (__u64)vaddr;
 	attach_info.fd = xpmem_fd;
-	attach_info.flags = 0;
+	attach_info.flags = flags;
 	if (xpmem_ioctl(XPMEM_CMD_ATTACH, &attach_info) == -1)
 		return (void *)-1;
 	return (void *)attach_info.vaddr;
 }
 
+int xpmem_prefetch(void *vaddr, size_t size)
+{
+	struct xpmem_cmd_prefetch prefetch_info;
+
+	prefetch_info.vaddr = (__u64)vaddr;
+	prefetch_info.size = size;
+	if (xpmem_ioctl(XPMEM_CMD_PREFETCH, &prefetch_info) == -1)
+		return -1;
+	return 0;
+}
+
 int xpmem_detach(void *vaddr)
 {
 	struct xpmem_cmd_detach detach_info;
@@ -113,9 +113,6 @@ AC_DEFUN([AC_KERNEL_CHECKS],
             -I$kerneldir/arch/$srcarch/include/generated/uapi \
             $CPPFLAGS"
 
-  AC_CHECK_MEMBERS([struct task_struct.cpus_mask], [], [],
-                   [[#include <linux/sched.h>]])
-
   AC_CHECK_DECL(pde_data, [], [
     AC_DEFINE([HAVE_NO_PDE_DATA_FUNC], 1, [Have pde_data()])
     AC_CHECK_DECL(PDE_DATA, [
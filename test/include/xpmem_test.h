@@ -1,6 +1,7 @@
 #ifndef _XPMEM_TEST_H
 #define _XPMEM_TEST_H
 
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -14,6 +15,13 @@
 #define TMP_SHARE_SIZE	32
 #define LOCK_INDEX	TMP_SHARE_SIZE - 1
 #define COW_LOCK_INDEX	TMP_SHARE_SIZE - 2
+#define ADD_INDEX	TMP_SHARE_SIZE - 3	/* times xpmem_proc2 added 1 */
+
+/* Written instead of a segid when the kernel lacks support for a test */
+#define SKIP_SHARE	"skip"
+
+/* Errors that mean a flag is not supported here rather than broken */
+#define flag_unsupported(err)	((err) == EOPNOTSUPP || (err) == EEXIST)
 
 xpmem_segid_t make_share(int **data, size_t size)
 {
@@ -37,6 +45,35 @@ xpmem_segid_t make_share(int **data, size_t size)
 	return segid;
 }
 
+xpmem_segid_t make_share_flags(int **data, size_t size, int flags)
+{
+	xpmem_segid_t segid;
+	int i;
+	int *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	for (i=0; i < (size / sizeof(int)); i++)
+		*(ptr + i) = i;
+
+	segid = xpmem_make_flags(ptr, size, XPMEM_PERMIT_MODE, (void *)0666,
+				 flags);
+	if (segid == -1) {
+		i = errno;
+		munmap(ptr, size);
+		errno = i;
+		return -1;
+	}
+
+	*data = ptr;
+	return segid;
+}
+
 int unmake_share(xpmem_segid_t segid, int *data, size_t size)
 {
 	int ret;
@@ -50,6 +87,31 @@ int unmake_share(xpmem_segid_t segid, int *data, size_t size)
 	return ret;
 }
 
+void *attach_segid_flags(xpmem_segid_t segid, xpmem_apid_t *apid,
+			 int permit, int flags)
+{
+	struct xpmem_addr addr;
+	void *buff;
+
+	*apid = xpmem_get(segid, permit, XPMEM_PERMIT_MODE, NULL);
+	if (*apid == -1) {
+		perror("xpmem_get");
+		return (void *)-1;
+	}
+
+	addr.apid = *apid;
+	addr.offset = 0;
+	buff = xpmem_attach_flags(addr, SHARE_SIZE, NULL, flags);
+	if (buff == (void *)-1) {
+		int err = errno;
+
+		xpmem_release(*apid);
+		errno = err;
+	}
+
+	return buff;
+}
+
 void *attach_segid(xpmem_segid_t segid, xpmem_apid_t *apid)
 {
 	struct xpmem_addr addr;
@@ -87,16 +149,31 @@ int test_base(test_args*);
 int test_two_attach(test_args*);
 int test_two_shares(test_args*);
 int test_fork(test_args*);
+int test_make_pin(test_args*);
+int test_make_pin_fork(test_args*);
+int test_make_migrate(test_args*);
+int test_make_place(test_args*);
+int test_seal(test_args*);
+int test_attach_flags(test_args*);
+int test_prefetch(test_args*);
 
 /* Create an array of test functions structs:
  * 	allows xpmem_master.c to loop over all the tests
  */
 #define add_test(name) { #name, name }
+#define FIRST_FLAGS_TEST	4	/* tests that need XPMEM_VERSION_FLAGS */
 test_struct xpmem_test[] = {
 	add_test(test_base),
 	add_test(test_two_attach),
 	add_test(test_two_shares),
 	add_test(test_fork),
+	add_test(test_make_pin),
+	add_test(test_make_pin_fork),
+	add_test(test_make_migrate),
+	add_test(test_make_place),
+	add_test(test_seal),
+	add_test(test_attach_flags),
+	add_test(test_prefetch),
 	{ NULL }
 };
 
@@ -25,14 +25,22 @@ int test_base(test_args* t) { return 0; }
 int test_two_attach(test_args* t) { return 0; }
 int test_two_shares(test_args* t) { return 0; }
 int test_fork(test_args* t) { return 0; }
+int test_make_pin(test_args* t) { return 0; }
+int test_make_pin_fork(test_args* t) { return 0; }
+int test_make_migrate(test_args* t) { return 0; }
+int test_make_place(test_args* t) { return 0; }
+int test_seal(test_args* t) { return 0; }
+int test_attach_flags(test_args* t) { return 0; }
+int test_prefetch(test_args* t) { return 0; }
 
 int main(int argc, char** argv)
 {
 	pid_t p1, p2;
-	int i, fd, lock, status[2];
+	int i, fd, lock, version, status[2];
 	char *share, test_nr[4];
 
-	printf("XPMEM version = %x\n\n", xpmem_version());
+	version = xpmem_version();
+	printf("XPMEM version = %x\n\n", version);
 
 	if ((fd = open("/tmp/xpmem.share", O_RDWR)) == -1) {
 		perror("open xpmem.share");
@@ -52,6 +60,10 @@ int main(int argc, char** argv)
 
 	/* Loop over all tests */
 	for (i=0; xpmem_test[i].name != NULL; ++i) {
+		if (i >= FIRST_FLAGS_TEST && version < XPMEM_VERSION_FLAGS) {
+			printf("==== %s SKIPPED ====\n\n", xpmem_test[i].name);
+			continue;
+		}
 		printf("==== %s STARTS ====\n", xpmem_test[i].name);
 		sprintf(test_nr, "%d", i);
 		memset(share, '\0', TMP_SHARE_SIZE);
@@ -221,6 +221,230 @@ int test_fork(test_args *xpmem_args)
 	}
 }
 
+/**
+ * share_flags - share a block made with make_flags for xpmem_proc2 to use
+ * Description:
+ *	Creates a share with xpmem_make_flags(), optionally seals it, and
+ *	waits for xpmem_proc2. Every element must then have been incremented
+ *	as many times as xpmem_proc2 reports in share[ADD_INDEX]. If the
+ *	kernel does not support make_flags, the test is skipped.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -1
+ */
+static int share_flags(test_args *xpmem_args, int make_flags, int seal)
+{
+	int i, ret=0, *data, expected;
+	xpmem_segid_t segid;
+
+	segid = make_share_flags(&data, SHARE_SIZE, make_flags);
+	if (segid == -1) {
+		if (flag_unsupported(errno)) {
+			printf("xpmem_proc1: make flags %#x not supported, "
+				"skipping\n\n", make_flags);
+			strcpy(xpmem_args->share, SKIP_SHARE);
+			xpmem_args->share[LOCK_INDEX] = 1;
+			return 0;
+		}
+		perror("xpmem_make_flags");
+		xpmem_args->share[LOCK_INDEX] = 1;
+		return -1;
+	}
+
+	if (seal && xpmem_seal(segid) == -1) {
+		perror("xpmem_seal");
+		ret = -1;
+	}
+
+	printf("xpmem_proc1: mypid = %d\n", getpid());
+	printf("xpmem_proc1: sharing %ld bytes, make flags %#x%s\n",
+		SHARE_SIZE, make_flags, seal ? ", sealed" : "");
+	printf("xpmem_proc1: segid = %llx at %p\n\n", segid, data);
+
+	/* Copy data to mmap share */
+	sprintf(xpmem_args->share, "%llx", segid);
+
+	/* Give control back to xpmem_master */
+	xpmem_args->share[LOCK_INDEX] = 1;
+
+	/* Wait for xpmem_proc2 to finish */
+	lockf(xpmem_args->lock, F_LOCK, 0);
+	lockf(xpmem_args->lock, F_ULOCK, 0);
+
+	printf("xpmem_proc1: verifying data...");
+	expected = xpmem_args->share[ADD_INDEX];
+	for (i = 0; i < SHARE_INT_SIZE; i++) {
+		if (*(data + i) != i + expected) {
+			printf("xpmem_proc1: ***mismatch at %d: expected %d "
+				"got %d\n", i, i + expected, *(data + i));
+			ret = -1;
+		}
+	}
+	printf("done\n");
+
+	unmake_share(segid, data, SHARE_SIZE);
+
+	return ret;
+}
+
+/**
+ * test_make_pin - share a block pinned up front
+ * Description:
+ *	Same as test_base with a XPMEM_MAKE_PIN segment.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -1
+ */
+int test_make_pin(test_args *xpmem_args)
+{
+	return share_flags(xpmem_args, XPMEM_MAKE_PIN, 0);
+}
+
+/**
+ * test_make_pin_fork - fork the source of a block pinned up front
+ * Description:
+ *	Creates a XPMEM_MAKE_PIN share, forks a child and adds 1 to all
+ *	elements while the child still shares the pages. The pinned pages must
+ *	stay with xpmem_proc1, so xpmem_proc2 has to see that write, and
+ *	xpmem_proc1 has to see the one xpmem_proc2 makes in turn.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -1
+ */
+int test_make_pin_fork(test_args *xpmem_args)
+{
+	int i, ret=0, *data, expected;
+	xpmem_segid_t segid;
+	pid_t p1_child;
+
+	segid = make_share_flags(&data, SHARE_SIZE, XPMEM_MAKE_PIN);
+	if (segid == -1) {
+		if (flag_unsupported(errno)) {
+			printf("xpmem_proc1: make flags %#x not supported, "
+				"skipping\n\n", XPMEM_MAKE_PIN);
+			strcpy(xpmem_args->share, SKIP_SHARE);
+			xpmem_args->share[LOCK_INDEX] = 1;
+			return 0;
+		}
+		perror("xpmem_make_flags");
+		xpmem_args->share[LOCK_INDEX] = 1;
+		return -1;
+	}
+
+	printf("xpmem_proc1: mypid = %d\n", getpid());
+	printf("xpmem_proc1: sharing %ld bytes, make flags %#x\n",
+		SHARE_SIZE, XPMEM_MAKE_PIN);
+	printf("xpmem_proc1: segid = %llx at %p\n\n", segid, data);
+
+	printf("xpmem_proc1: forking a child\n");
+	p1_child = fork();
+	if (p1_child == -1) {
+		perror("fork");
+		ret = -1;
+	} else if (p1_child == 0) {
+		printf("\nxpmem_child: hello from pid %d\n\n", getpid());
+		sleep(1);
+		_exit(0);
+	} else {
+		printf("xpmem_proc1: adding 1 to all elems after the fork\n");
+		for (i = 0; i < SHARE_INT_SIZE; i++)
+			*(data + i) += 1;
+		waitpid(p1_child, NULL, 0);
+	}
+
+	/* Copy data to mmap share */
+	sprintf(xpmem_args->share, "%llx", segid);
+
+	/* Give control back to xpmem_master */
+	xpmem_args->share[LOCK_INDEX] = 1;
+
+	/* Wait for xpmem_proc2 to finish */
+	lockf(xpmem_args->lock, F_LOCK, 0);
+	lockf(xpmem_args->lock, F_ULOCK, 0);
+
+	printf("xpmem_proc1: verifying data...");
+	expected = 1 + xpmem_args->share[ADD_INDEX];
+	for (i = 0; i < SHARE_INT_SIZE; i++) {
+		if (*(data + i) != i + expected) {
+			printf("xpmem_proc1: ***mismatch at %d: expected %d "
+				"got %d\n", i, i + expected, *(data + i));
+			ret = -1;
+		}
+	}
+	printf("done\n");
+
+	unmake_share(segid, data, SHARE_SIZE);
+
+	return ret;
+}
+
+/**
+ * test_make_migrate - share a block whose pages follow their consumers
+ * Description:
+ *	Same as test_base with a XPMEM_MAKE_MIGRATE segment.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -1
+ */
+int test_make_migrate(test_args *xpmem_args)
+{
+	return share_flags(xpmem_args, XPMEM_MAKE_MIGRATE, 0);
+}
+
+/**
+ * test_make_place - share a block with a placement policy
+ * Description:
+ *	Same as test_base with a XPMEM_PLACE_INTERLEAVE segment. xpmem_proc2
+ *	attaches with policies overriding it.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -1
+ */
+int test_make_place(test_args *xpmem_args)
+{
+	return share_flags(xpmem_args, XPMEM_PLACE_INTERLEAVE, 0);
+}
+
+/**
+ * test_seal - share a sealed block
+ * Description:
+ *	Seals the share with xpmem_seal() before xpmem_proc2 attaches to it,
+ *	read-write and with read-only replicas.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -1
+ */
+int test_seal(test_args *xpmem_args)
+{
+	return share_flags(xpmem_args, 0, 1);
+}
+
+/**
+ * test_attach_flags - share a block attached with each attach flag
+ * Description:
+ *	See xpmem_proc2.c.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -1
+ */
+int test_attach_flags(test_args *xpmem_args)
+{
+	return share_flags(xpmem_args, 0, 0);
+}
+
+/**
+ * test_prefetch - share a block that is prefetched by its consumer
+ * Description:
+ *	See xpmem_proc2.c.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -1
+ */
+int test_prefetch(test_args *xpmem_args)
+{
+	return share_flags(xpmem_args, 0, 0);
+}
+
 int main(int argc, char **argv)
 {
 	test_args xpmem_args;
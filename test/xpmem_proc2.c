@@ -221,6 +221,283 @@ int test_fork(test_args *xpmem_args)
 	return ret;
 }
 
+/**
+ * check_add - verify an attachment made by xpmem_proc1's share_flags()
+ * Description:
+ *	Checks that every element was incremented added times so far and,
+ *	if add is set, increments it once more.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -2
+ */
+static int check_add(int *data, int added, int add)
+{
+	int i, ret=0;
+
+	for (i = 0; i < SHARE_INT_SIZE; i++) {
+		if (*(data + i) != i + added) {
+			printf("xpmem_proc2: ***mismatch at %d: expected %d "
+				"got %d\n", i, i + added, *(data + i));
+			ret = -2;
+		}
+		if (add)
+			*(data + i) += 1;
+	}
+
+	return ret;
+}
+
+/**
+ * attach_add - attach with flags, verify and increment
+ * Description:
+ *	Attaches the whole share with the given permit and attach flags and
+ *	runs check_add() on it. Flags the kernel does not support are
+ *	skipped.
+ * Return Values:
+ *	Success: 1 if the elements were incremented, 0 otherwise
+ *	Failure: -2
+ */
+static int attach_add(xpmem_segid_t segid, int permit, int flags, int added,
+		      int add)
+{
+	xpmem_apid_t apid;
+	int ret, *data;
+
+	data = attach_segid_flags(segid, &apid, permit, flags);
+	if (data == (void *)-1) {
+		if (flag_unsupported(errno)) {
+			printf("xpmem_proc2: attach flags %#x not supported, "
+				"skipping\n", flags);
+			return 0;
+		}
+		perror("xpmem_attach_flags");
+		return -2;
+	}
+
+	printf("xpmem_proc2: attached with flags %#x at %p\n", flags, data);
+	ret = check_add(data, added, add);
+
+	xpmem_detach(data);
+	xpmem_release(apid);
+
+	return (ret == 0) ? !!add : ret;
+}
+
+/**
+ * share_segid - get the segid shared by xpmem_proc1
+ * Return Values:
+ *	Success: 1
+ *	Skipped: 0, xpmem_proc1 could not make the segment
+ */
+static int share_segid(test_args *xpmem_args, xpmem_segid_t *segid)
+{
+	if (strcmp(xpmem_args->share, SKIP_SHARE) == 0)
+		return 0;
+
+	*segid = strtol(xpmem_args->share, NULL, 16);
+	printf("xpmem_proc2: mypid = %d\n", getpid());
+	printf("xpmem_proc2: segid = %llx\n", *segid);
+	return 1;
+}
+
+/**
+ * test_make_pin - attach to a segment pinned up front
+ * Description:
+ *	Same as test_base.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -2
+ */
+int test_make_pin(test_args *xpmem_args)
+{
+	xpmem_segid_t segid;
+	int ret;
+
+	if (!share_segid(xpmem_args, &segid))
+		return 0;
+
+	ret = attach_add(segid, XPMEM_RDWR, 0, 0, 1);
+	if (ret < 0)
+		return ret;
+	xpmem_args->share[ADD_INDEX] = ret;
+	return 0;
+}
+
+/**
+ * test_make_pin_fork - attach to a pinned segment whose source forked
+ * Description:
+ *	Checks that xpmem_proc1's write after its fork is visible, then adds
+ *	1 to all elements.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -2
+ */
+int test_make_pin_fork(test_args *xpmem_args)
+{
+	xpmem_segid_t segid;
+	int ret;
+
+	if (!share_segid(xpmem_args, &segid))
+		return 0;
+
+	ret = attach_add(segid, XPMEM_RDWR, 0, 1, 1);
+	if (ret < 0)
+		return ret;
+	xpmem_args->share[ADD_INDEX] = ret;
+	return 0;
+}
+
+/**
+ * test_make_migrate - attach to a segment whose pages follow consumers
+ * Description:
+ *	Same as test_base.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -2
+ */
+int test_make_migrate(test_args *xpmem_args)
+{
+	return test_make_pin(xpmem_args);
+}
+
+/**
+ * test_make_place - override the placement policy of a segment
+ * Description:
+ *	Attaches twice, with XPMEM_PLACE_CONSUMER and XPMEM_PLACE_NODE(0),
+ *	adding 1 to all elements each time.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -2
+ */
+int test_make_place(test_args *xpmem_args)
+{
+	int place[] = { XPMEM_PLACE_CONSUMER, XPMEM_PLACE_NODE(0) };
+	xpmem_segid_t segid;
+	int i, ret, added = 0;
+
+	if (!share_segid(xpmem_args, &segid))
+		return 0;
+
+	for (i = 0; i < sizeof(place) / sizeof(place[0]); i++) {
+		ret = attach_add(segid, XPMEM_RDWR, place[i], added, 1);
+		if (ret < 0)
+			return ret;
+		added += ret;
+	}
+	xpmem_args->share[ADD_INDEX] = added;
+	return 0;
+}
+
+/**
+ * test_seal - attach to a sealed segment
+ * Description:
+ *	Adds 1 to all elements through a read-write attachment, then checks
+ *	them through read-only replicas.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -2
+ */
+int test_seal(test_args *xpmem_args)
+{
+	xpmem_segid_t segid;
+	int ret, added;
+
+	if (!share_segid(xpmem_args, &segid))
+		return 0;
+
+	added = attach_add(segid, XPMEM_RDWR, 0, 0, 1);
+	if (added < 0)
+		return added;
+	xpmem_args->share[ADD_INDEX] = added;
+
+	ret = attach_add(segid, XPMEM_RDONLY,
+			 XPMEM_ATTACH_RDONLY | XPMEM_ATTACH_REPLICATE, added, 0);
+	return (ret < 0) ? ret : 0;
+}
+
+/**
+ * test_attach_flags - attach with each attach flag
+ * Description:
+ *	Attaches once per XPMEM_ATTACH_* flag, adding 1 to all elements
+ *	through each writable attachment. Flags the kernel does not support
+ *	are skipped.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -2
+ */
+int test_attach_flags(test_args *xpmem_args)
+{
+	int flags[] = {
+		XPMEM_ATTACH_NOFAULTAROUND,
+		XPMEM_ATTACH_POPULATE,
+		XPMEM_ATTACH_NOPIN,
+		XPMEM_ATTACH_PAGES,
+		XPMEM_ATTACH_WAIT,
+		XPMEM_ATTACH_SAMEVA,
+		XPMEM_ATTACH_POPULATE | XPMEM_ATTACH_NOFAULTAROUND,
+	};
+	xpmem_segid_t segid;
+	int i, ret, added = 0;
+
+	if (!share_segid(xpmem_args, &segid))
+		return 0;
+
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		ret = attach_add(segid, XPMEM_RDWR, flags[i], added, 1);
+		if (ret < 0)
+			return ret;
+		added += ret;
+	}
+	xpmem_args->share[ADD_INDEX] = added;
+
+	/* read-only, both asked for and implied by the permit */
+	ret = attach_add(segid, XPMEM_RDWR, XPMEM_ATTACH_RDONLY, added, 0);
+	if (ret < 0)
+		return ret;
+	ret = attach_add(segid, XPMEM_RDONLY, 0, added, 0);
+	return (ret < 0) ? ret : 0;
+}
+
+/**
+ * test_prefetch - prefetch an attachment before using it
+ * Description:
+ *	Same as test_base, with xpmem_prefetch() called on the attachment
+ *	first.
+ * Return Values:
+ *	Success: 0
+ *	Failure: -2
+ */
+int test_prefetch(test_args *xpmem_args)
+{
+	xpmem_segid_t segid;
+	xpmem_apid_t apid;
+	int ret, *data;
+
+	if (!share_segid(xpmem_args, &segid))
+		return 0;
+
+	data = attach_segid(segid, &apid);
+	if (data == (void *)-1) {
+		perror("xpmem_attach");
+		return -2;
+	}
+	printf("xpmem_proc2: attached at %p\n", data);
+
+	if (xpmem_prefetch(data, SHARE_SIZE) == -1) {
+		perror("xpmem_prefetch");
+		ret = -2;
+	} else {
+		ret = check_add(data, 0, 1);
+		if (ret == 0)
+			xpmem_args->share[ADD_INDEX] = 1;
+	}
+
+	xpmem_detach(data);
+	xpmem_release(apid);
+
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	test_args xpmem_args;